@@ -8,15 +8,52 @@
 #include <linux/acpi.h>
 #include <linux/debugfs.h>
 #include <linux/cpuhotplug.h>
+#include <linux/iommu.h>
+#include <linux/math64.h>
+#include <linux/irq_work.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/of.h>
+#include <linux/pci.h>
 #include <linux/perf_event.h>
 #include <linux/platform_device.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/isolation.h>
+#include <linux/vmalloc.h>
+#include <asm/cputype.h>
+#include <asm/irq_regs.h>
 
-#define TX2_PMU_HRTIMER_INTERVAL	(1 * NSEC_PER_SEC)
+#include "tx2_uncore_smmu_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "tx2_uncore_smmu_trace.h"
+
+#define TX2_PMU_HRTIMER_MIN_INTERVAL	(10 * NSEC_PER_MSEC)
+#define TX2_PMU_HRTIMER_MAX_INTERVAL	(2 * NSEC_PER_SEC)
+/* upper bound for either interval when set through sysfs */
+#define TX2_PMU_HRTIMER_LIMIT		(60 * NSEC_PER_SEC)
+/*
+ * The 32-bit counters are sampled at least this many times per wrap
+ * period at the last observed rate, so the rate may grow by the same
+ * factor before the next sample without losing a wrap.
+ */
+#define TX2_PMU_HRTIMER_HEADROOM	4
+#define TX2_PMU_RING_INTERVAL		(10 * NSEC_PER_MSEC)
+#define TX2_PMU_RING_MIN_INTERVAL	(1 * NSEC_PER_MSEC)
+#define TX2_PMU_SAMPLE_INTERVAL		(1 * NSEC_PER_MSEC)
+#define TX2_PMU_RECORDER_RECORDS	512
+#define TX2_PMU_RECORDER_INTERVAL	(10 * NSEC_PER_MSEC)
+#define TX2_PMU_RECORDER_FAST_INTERVAL	(1 * NSEC_PER_MSEC)
+#define TX2_PMU_RECORDER_POST		(100 * NSEC_PER_MSEC)
 #define GET_EVENTID(ev)			((ev->hw.config) & 0xff)
+#define GET_FILTER(ev)			((ev->hw.config) >> 32)
+#define GET_ARID(ev)			((ev->attr.config1) & 0xffff)
+#define GET_ARID_MASK(ev)		((ev->attr.config1 >> 16) & 0xffff)
+#define GET_PCI_DEVFN(ev)		((ev->attr.config2) & 0xff)
+#define GET_PCI_BUS(ev)			((ev->attr.config2 >> 8) & 0xff)
+#define GET_PCI_SEG(ev)			((ev->attr.config2 >> 16) & 0xffff)
 #define GET_COUNTERID(ev)		((ev->hw.idx) & 0xff)
 
-#define TX2_PMU_SMMU_MAX_COUNTERS	32
-
 /* Register offset */
 #define SMMU_INTERRUPT                   0x412
 #define SMMU_INTERRUPT_EN                0x413
@@ -68,9 +105,41 @@
 #define SMMU_PERF_TLB_PGSZ_1G_HIT        0x445
 #define SMMU_PERF_TLB_PGSZ_16G_HIT       0x446
 
-#define SMMU_BASE_ADDR	0x402300000
-#define SMMU_BASE(node, smmu)	\
-	(SMMU_BASE_ADDR + (node * 0x40000000) + (smmu * 0x20000))
+/*
+ * SMMU_PERF_CTL value that starts the counters, as written by the
+ * original driver. The individual enable bits are not documented, so
+ * events are gated in software and the register is only ever written
+ * with this value or zero.
+ */
+#define SMMU_PERF_CTL_ENABLE		0xfffffc07
+
+/*
+ * SMMU_PERF_FILTER_ARID fields: only transactions whose ARID matches
+ * FILTER_ARID in the bits set in FILTER_MASK are counted. A zero mask
+ * counts every transaction.
+ */
+#define SMMU_PERF_FILTER_ARID_SHIFT	0
+#define SMMU_PERF_FILTER_MASK_SHIFT	16
+
+static bool mmio64;
+module_param(mmio64, bool, 0444);
+MODULE_PARM_DESC(mmio64, "Read 64-bit counters with a single 64-bit access");
+
+static bool always_on;
+module_param(always_on, bool, 0444);
+MODULE_PARM_DESC(always_on, "Count every event from module load on, see totals");
+
+static unsigned int ring_pages = 64;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Pages of counter snapshot records per PMU ring, 0 for none");
+
+static bool mmio_timing;
+module_param(mmio_timing, bool, 0644);
+MODULE_PARM_DESC(mmio_timing, "Time counter reads for the mmio_read_ns histogram in debugfs");
+
+/* the SMMUs of a socket sit in its 1GB slice above this address */
+#define SMMU_BASE_ADDR		0x402300000
+#define SMMU_NODE_STRIDE	0x40000000
 
 #define dump_register(nm)	\
 {				\
@@ -184,60 +253,152 @@ static const struct debugfs_reg32 asmmu_debug_regs[] = {
 	dump_register(SMMU_SMMU_PERF_TLB_PGSZ_16G_HIT),
 };
 
+/*
+ * SMMU events: id, counter register, width in bits and sysfs
+ * name. The position in the table is the perf
+ * event id, so new events are only ever appended.
+ */
+#define SMMU_PERF_EVENTS(E)						\
+	E(NUM_CYCLES, SMMU_PERF_NUM_CYCLES, 64,				\
+	  cycles)							\
+	E(ARID_CONT_CACHE_HIT, SMMU_PERF_ARID_CONT_CACHE_HIT, 64,	\
+	  aridcont_cache_hit)						\
+	E(ARID_CONT_CACHE_MISS, SMMU_PERF_ARID_CONT_CACHE_MISS, 64,	\
+	  aridcont_cache_miss)						\
+	E(ARID_CONT_CACHE_EVICT, SMMU_PERF_ARID_CONT_CACHE_EVICT, 32,	\
+	  aridcont_cache_evict)						\
+	E(ARID_CACHE_HIT, SMMU_PERF_ARID_CACHE_HIT, 64,			\
+	  arid_cache_hit)						\
+	E(ARID_CACHE_MISS, SMMU_PERF_ARID_CACHE_MISS, 64,		\
+	  arid_cache_miss)						\
+	E(ARID_CACHE_EVICT, SMMU_PERF_ARID_CACHE_EVICT, 32,		\
+	  arid_cache_evict)						\
+	E(MAIN_TLB_HIT, SMMU_PERF_MAIN_TLB_HIT, 64,			\
+	  tlb_hit)							\
+	E(MAIN_TLB_MISS, SMMU_PERF_MAIN_TLB_MISS, 64,			\
+	  tlb_miss)							\
+	E(MAIN_TLB_EVICT, SMMU_PERF_MAIN_TLB_EVICT, 32,			\
+	  tlb_evict)							\
+	E(PWC_HIT, SMMU_PERF_PWC_HIT, 64,				\
+	  pwc_hit)							\
+	E(PWC_MISS, SMMU_PERF_PWC_MISS, 64,				\
+	  pwc_miss)							\
+	E(PWC_EVICT, SMMU_PERF_PWC_EVICT, 32,				\
+	  pwc_evict)							\
+	E(PRIQ_REQ, SMMU_PERF_PRIQ_REQ, 32,				\
+	  priq_req)							\
+	E(ARID_INVALIDATION, SMMU_PERF_ARID_INVALIDATION, 32,		\
+	  arid_inv)							\
+	E(TLB_INVALIDATION, SMMU_PERF_TLB_INVALIDATION, 32,		\
+	  tlb_inv)							\
+	E(DEVICE_INVALIDATION, SMMU_PERF_DEVICE_INVALIDATION, 32,	\
+	  device_inv)							\
+	E(TLB_PGSZ_4K_HIT, SMMU_PERF_TLB_PGSZ_4K_HIT, 32,		\
+	  tlb_hit_4k)							\
+	E(TLB_PGSZ_64K_HIT, SMMU_PERF_TLB_PGSZ_64K_HIT, 32,		\
+	  tlb_hit_64k)							\
+	E(TLB_PGSZ_2M_HIT, SMMU_PERF_TLB_PGSZ_2M_HIT, 32,		\
+	  tlb_hit_2m)							\
+	E(TLB_PGSZ_32M_HIT, SMMU_PERF_TLB_PGSZ_32M_HIT, 32,		\
+	  tlb_hit_32m)							\
+	E(TLB_PGSZ_512M_HIT, SMMU_PERF_TLB_PGSZ_512M_HIT, 32,		\
+	  tlb_hit_512m)							\
+	E(TLB_PGSZ_1G_HIT, SMMU_PERF_TLB_PGSZ_1G_HIT, 32,		\
+	  tlb_hit_1g)							\
+	E(TLB_PGSZ_16G_HIT, SMMU_PERF_TLB_PGSZ_16G_HIT, 32,		\
+	  tlb_hit_16g)							\
+	E(WALKERS_FULL, SMMU_PERF_WALKERS_FULL, 32,			\
+	  walkers_full)
+
+#define SMMU_EVENT_ENUM(id, reg, width, name)	SMMU_PERF_EVENT_##id,
+enum SMMU_PERF_EVENTS {
+	SMMU_PERF_EVENTS(SMMU_EVENT_ENUM)
+	SMMU_PERF_EVENT_MAX
+};
 
+#define SMMU_EVENT_OFFSET(id, reg, width, name)	\
+	[SMMU_PERF_EVENT_##id] = reg,
 static const unsigned long smmu_event_hw_offset[] = {
-	SMMU_PERF_NUM_CYCLES,
-	SMMU_PERF_ARID_CONT_CACHE_HIT,
-	SMMU_PERF_ARID_CONT_CACHE_MISS,
-	SMMU_PERF_ARID_CONT_CACHE_EVICT,
-	SMMU_PERF_ARID_CACHE_HIT,
-	SMMU_PERF_ARID_CACHE_MISS,
-	SMMU_PERF_ARID_CACHE_EVICT,
-	SMMU_PERF_MAIN_TLB_HIT,
-	SMMU_PERF_MAIN_TLB_MISS,
-	SMMU_PERF_MAIN_TLB_EVICT,
-	SMMU_PERF_PWC_HIT,
-	SMMU_PERF_PWC_MISS,
-	SMMU_PERF_PWC_EVICT,
-	SMMU_PERF_PRIQ_REQ,
-	SMMU_PERF_ARID_INVALIDATION,
-	SMMU_PERF_TLB_INVALIDATION,
-	SMMU_PERF_DEVICE_INVALIDATION,
-	SMMU_PERF_TLB_PGSZ_4K_HIT,
-	SMMU_PERF_TLB_PGSZ_64K_HIT,
-	SMMU_PERF_TLB_PGSZ_2M_HIT,
-	SMMU_PERF_TLB_PGSZ_32M_HIT,
-	SMMU_PERF_TLB_PGSZ_512M_HIT,
-	SMMU_PERF_TLB_PGSZ_1G_HIT,
-	SMMU_PERF_TLB_PGSZ_16G_HIT,
+	SMMU_PERF_EVENTS(SMMU_EVENT_OFFSET)
 };
 
-enum SMMU_PERF_EVENTS {
-	SMMU_PERF_EVENT_NUM_CYCLES,
-	SMMU_PERF_EVENT_ARID_CONT_CACHE_HIT,
-	SMMU_PERF_EVENT_ARID_CONT_CACHE_MISS,
-	SMMU_PERF_EVENT_ARID_CONT_CACHE_EVICT,
-	SMMU_PERF_EVENT_ARID_CACHE_HIT,
-	SMMU_PERF_EVENT_ARID_CACHE_MISS,
-	SMMU_PERF_EVENT_ARID_CACHE_EVICT,
-	SMMU_PERF_EVENT_MAIN_TLB_HIT,
-	SMMU_PERF_EVENT_MAIN_TLB_MISS,
-	SMMU_PERF_EVENT_MAIN_TLB_EVICT,
-	SMMU_PERF_EVENT_PWC_HIT,
-	SMMU_PERF_EVENT_PWC_MISS,
-	SMMU_PERF_EVENT_PWC_EVICT,
-	SMMU_PERF_EVENT_PRIQ_REQ,
-	SMMU_PERF_EVENT_ARID_INVALIDATION,
-	SMMU_PERF_EVENT_TLB_INVALIDATION,
-	SMMU_PERF_EVENT_DEVICE_INVALIDATION,
-	SMMU_PERF_EVENT_TLB_PGSZ_4K_HIT,
-	SMMU_PERF_EVENT_TLB_PGSZ_64K_HIT,
-	SMMU_PERF_EVENT_TLB_PGSZ_2M_HIT,
-	SMMU_PERF_EVENT_TLB_PGSZ_32M_HIT,
-	SMMU_PERF_EVENT_TLB_PGSZ_512M_HIT,
-	SMMU_PERF_EVENT_TLB_PGSZ_1G_HIT,
-	SMMU_PERF_EVENT_TLB_PGSZ_16G_HIT,
-	SMMU_PERF_EVENT_MAX
+/* Counter width in bits, indexed by event id */
+#define SMMU_EVENT_WIDTH(id, reg, width, name)	\
+	[SMMU_PERF_EVENT_##id] = width,
+static const u8 smmu_event_width[] = {
+	SMMU_PERF_EVENTS(SMMU_EVENT_WIDTH)
+};
+
+/* sysfs name of each event, indexed by event id */
+#define SMMU_EVENT_NAME(id, reg, width, name)	\
+	[SMMU_PERF_EVENT_##id] = #name,
+static const char *const smmu_event_name[] = {
+	SMMU_PERF_EVENTS(SMMU_EVENT_NAME)
+};
+
+/*
+ * Software state of a fixed-function hardware counter: the last value
+ * read from the hardware, the 64-bit running total built from it and
+ * the total seen by the previous rate estimate.
+ *
+ * Counters are read from any CPU of the package, concurrently with the
+ * engine sweep, so prev and total are only ever updated atomically.
+ * The reference counts are changed by the events of the PMU and by the
+ * events of the aggregate PMUs on other CPUs, under the PMU lock.
+ */
+struct tx2_smmu_counter {
+	atomic64_t prev;
+	atomic64_t total;
+	u64 rate_total;
+	int refcnt;
+};
+
+/*
+ * Per-node sampling engine. A single hrtimer services every SMMU PMU of
+ * the socket that has active counters, so a socket takes one wakeup per
+ * interval however many of its SMMUs are counting. The timer is pinned
+ * to a housekeeping CPU of the node, the one servicing the PMU that
+ * armed it, which is kicked through kick_work when it is not the caller.
+ */
+struct tx2_smmu_engine {
+	struct hrtimer hrtimer;
+	struct irq_work kick_work;
+	raw_spinlock_t lock;
+	struct list_head pmus;
+	int node;
+	unsigned int cpu;
+	u64 interval;
+};
+
+/*
+ * Cost of the driver itself, per CPU so the hot paths only do local
+ * increments. Summed up by the stats file in debugfs.
+ */
+#define TX2_SMMU_STATS_LAT_BUCKETS	16
+
+struct tx2_smmu_stats {
+	u64 timer_fires;
+	u64 timer_ns;
+	u64 mmio_reads;
+	u64 mmio_writes;
+	u64 event_add;
+	u64 event_del;
+	/* log2 buckets of read latency in ns, the last one is open */
+	u64 read_lat[TX2_SMMU_STATS_LAT_BUCKETS];
+};
+
+enum tx2_recorder_state {
+	TX2_RECORDER_OFF,
+	TX2_RECORDER_ARMED,
+	TX2_RECORDER_TRIGGERED,
+	TX2_RECORDER_FROZEN,
+};
+
+static const char * const tx2_recorder_state_name[] = {
+	[TX2_RECORDER_OFF]		= "off",
+	[TX2_RECORDER_ARMED]		= "armed",
+	[TX2_RECORDER_TRIGGERED]	= "triggered",
+	[TX2_RECORDER_FROZEN]		= "frozen",
 };
 
 struct tx2_uncore_pmu {
@@ -250,14 +411,66 @@ struct tx2_uncore_pmu {
 	u32 max_counters;
 	u32 max_events;
 	u64 hrtimer_interval;
+	u64 hrtimer_min_interval;
+	u64 hrtimer_max_interval;
+	ktime_t rate_stamp;
+	u64 sweep_time;
+	u64 read_staleness;
+	u64 narrow_rate;
+	bool narrow_active;
+	bool mmio64;
+	raw_spinlock_t lock;
+	int nr_running;
+	unsigned int txn_flags;
+	struct list_head txn_events;
+	struct hrtimer sample_timer;
+	struct list_head sample_events;
+	u32 filter;
+	int filter_users;
+	phys_addr_t phys_base;
+	struct device *smmu;
+	struct kobject *endpoints;
 	void __iomem *base;
-	DECLARE_BITMAP(active_counters, TX2_PMU_SMMU_MAX_COUNTERS);
-	struct perf_event *events[TX2_PMU_SMMU_MAX_COUNTERS];
-	struct hrtimer hrtimer;
+	DECLARE_BITMAP(active_counters, SMMU_PERF_EVENT_MAX);
+	struct tx2_smmu_counter counters[SMMU_PERF_EVENT_MAX] ____cacheline_aligned;
+	struct tx2_smmu_engine *engine;
+	struct list_head engine_entry;
+	struct miscdevice ring_dev;
+	unsigned long ring_busy;
+	struct tx2_smmu_ring_header *ring;
+	struct tx2_smmu_ring_record *ring_records;
+	u32 ring_nr;
+	u64 ring_head;
+	u64 ring_interval;
+	struct mutex threshold_lock;
+	bool thresholds_closed;
+	int nr_thresholds;
+	u64 thresholds[SMMU_PERF_EVENT_MAX];
+	u64 threshold_total[SMMU_PERF_EVENT_MAX];
+	ktime_t threshold_stamp;
+	unsigned long alerts;
+	struct work_struct alert_work;
+	struct mutex recorder_lock;
+	bool recorder_closed;
+	int recorder_state;
+	struct tx2_smmu_ring_record *recorder;
+	u64 recorder_head;
+	u64 recorder_trigger_time;
+	u64 recorder_freeze_time;
+	u64 recorder_interval;
+	u64 recorder_next;
+	u64 recorder_fast_interval;
+	u64 recorder_post;
+	struct work_struct recorder_work;
 	const struct attribute_group **attr_groups;
+	struct tx2_smmu_stats __percpu *stats;
+	struct dentry *debugfs;
 };
 
 static LIST_HEAD(tx2_pmus);
+static DEFINE_MUTEX(tx2_pmus_lock);
+static enum cpuhp_state tx2_smmu_hp_state;
+static struct tx2_smmu_engine *tx2_smmu_engines[MAX_NUMNODES];
 
 static inline struct tx2_uncore_pmu *pmu_to_tx2_pmu(struct pmu *pmu)
 {
@@ -265,9 +478,23 @@ static inline struct tx2_uncore_pmu *pmu_to_tx2_pmu(struct pmu *pmu)
 }
 
 PMU_FORMAT_ATTR(event,	"config:0-9");
+PMU_FORMAT_ATTR(arid,	"config1:0-15");
+PMU_FORMAT_ATTR(arid_mask,	"config1:16-31");
+PMU_FORMAT_ATTR(filter,		"config1:32");
+PMU_FORMAT_ATTR(pci_fn,	"config2:0-2");
+PMU_FORMAT_ATTR(pci_dev,	"config2:3-7");
+PMU_FORMAT_ATTR(pci_bus,	"config2:8-15");
+PMU_FORMAT_ATTR(pci_seg,	"config2:16-31");
 
 static struct attribute *smmu_pmu_format_attrs[] = {
 	&format_attr_event.attr,
+	&format_attr_arid.attr,
+	&format_attr_arid_mask.attr,
+	&format_attr_filter.attr,
+	&format_attr_pci_fn.attr,
+	&format_attr_pci_dev.attr,
+	&format_attr_pci_bus.attr,
+	&format_attr_pci_seg.attr,
 	NULL,
 };
 
@@ -292,38 +519,14 @@ static ssize_t tx2_pmu_event_show(struct device *dev,
 	PMU_EVENT_ATTR(name, tx2_pmu_event_attr_##name, \
 			config, tx2_pmu_event_show)
 
-TX2_EVENT_ATTR(cycles, SMMU_PERF_EVENT_NUM_CYCLES);
-TX2_EVENT_ATTR(aridcont_cache_miss, SMMU_PERF_EVENT_ARID_CONT_CACHE_MISS);
-TX2_EVENT_ATTR(arid_cache_miss, SMMU_PERF_EVENT_ARID_CACHE_MISS);
-TX2_EVENT_ATTR(tlb_hit, SMMU_PERF_EVENT_MAIN_TLB_HIT);
-TX2_EVENT_ATTR(tlb_miss, SMMU_PERF_EVENT_MAIN_TLB_MISS);
-TX2_EVENT_ATTR(tlb_evict, SMMU_PERF_EVENT_MAIN_TLB_EVICT);
-TX2_EVENT_ATTR(pwc_hit, SMMU_PERF_EVENT_PWC_HIT);
-TX2_EVENT_ATTR(pwc_miss, SMMU_PERF_EVENT_PWC_MISS);
-TX2_EVENT_ATTR(pwc_evict, SMMU_PERF_EVENT_PWC_EVICT);
-TX2_EVENT_ATTR(priq_req, SMMU_PERF_EVENT_PRIQ_REQ);
-TX2_EVENT_ATTR(tlb_inv, SMMU_PERF_EVENT_TLB_INVALIDATION);
-TX2_EVENT_ATTR(tlb_hit_4k, SMMU_PERF_EVENT_TLB_PGSZ_4K_HIT);
-TX2_EVENT_ATTR(tlb_hit_64k, SMMU_PERF_EVENT_TLB_PGSZ_64K_HIT);
-TX2_EVENT_ATTR(tlb_hit_2m, SMMU_PERF_EVENT_TLB_PGSZ_2M_HIT);
-TX2_EVENT_ATTR(tlb_hit_512m, SMMU_PERF_EVENT_TLB_PGSZ_512M_HIT);
+#define SMMU_EVENT_ATTR(id, reg, width, name)	\
+	TX2_EVENT_ATTR(name, SMMU_PERF_EVENT_##id);
+SMMU_PERF_EVENTS(SMMU_EVENT_ATTR)
 
+#define SMMU_EVENT_ATTR_PTR(id, reg, width, name)	\
+	&tx2_pmu_event_attr_##name.attr.attr,
 static struct attribute *smmu_pmu_events_attrs[] = {
-	&tx2_pmu_event_attr_cycles.attr.attr,
-	&tx2_pmu_event_attr_aridcont_cache_miss.attr.attr,
-	&tx2_pmu_event_attr_arid_cache_miss.attr.attr,
-	&tx2_pmu_event_attr_tlb_hit.attr.attr,
-	&tx2_pmu_event_attr_tlb_miss.attr.attr,
-	&tx2_pmu_event_attr_tlb_evict.attr.attr,
-	&tx2_pmu_event_attr_pwc_hit.attr.attr,
-	&tx2_pmu_event_attr_pwc_miss.attr.attr,
-	&tx2_pmu_event_attr_pwc_evict.attr.attr,
-	&tx2_pmu_event_attr_priq_req.attr.attr,
-	&tx2_pmu_event_attr_tlb_inv.attr.attr,
-	&tx2_pmu_event_attr_tlb_hit_4k.attr.attr,
-	&tx2_pmu_event_attr_tlb_hit_64k.attr.attr,
-	&tx2_pmu_event_attr_tlb_hit_2m.attr.attr,
-	&tx2_pmu_event_attr_tlb_hit_512m.attr.attr,
+	SMMU_PERF_EVENTS(SMMU_EVENT_ATTR_PTR)
 	NULL
 };
 
@@ -333,17 +536,119 @@ static const struct attribute_group smmu_pmu_events_attr_group = {
 };
 
 /*
- * sysfs cpumask attributes
+ * Isolated CPUs (isolcpus, nohz_full, managed_irq) run latency sensitive
+ * work and must not take PMUs or the sampling engine of a node.
+ */
+static bool tx2_uncore_housekeeping_cpu(unsigned int cpu)
+{
+	return housekeeping_cpu(cpu, HK_TYPE_DOMAIN) &&
+		housekeeping_cpu(cpu, HK_TYPE_TICK) &&
+		housekeeping_cpu(cpu, HK_TYPE_MANAGED_IRQ);
+}
+
+/* The CPUs that may service a PMU, all of them for uncore_smmu_all */
+static const struct cpumask *tx2_uncore_pmu_cpus(struct tx2_uncore_pmu *tx2_pmu)
+{
+	if (tx2_pmu->node == NUMA_NO_NODE)
+		return cpu_possible_mask;
+	return cpumask_of_node(tx2_pmu->node);
+}
+
+/*
+ * Pick the CPU servicing a PMU: the online housekeeping CPU of its node
+ * that services the fewest other PMUs, so the PMUs of a node are spread
+ * over its CPUs. Fall back to any online CPU of the node when all of
+ * them are isolated.
+ */
+static unsigned int tx2_uncore_pick_cpu(struct tx2_uncore_pmu *tx2_pmu,
+		unsigned int exclude)
+{
+	unsigned int cpu, best = nr_cpu_ids, fallback = nr_cpu_ids;
+	unsigned int load, best_load = UINT_MAX;
+	struct tx2_uncore_pmu *other;
+
+	for_each_cpu_and(cpu, tx2_uncore_pmu_cpus(tx2_pmu), cpu_online_mask) {
+		if (cpu == exclude)
+			continue;
+		if (fallback >= nr_cpu_ids)
+			fallback = cpu;
+		if (!tx2_uncore_housekeeping_cpu(cpu))
+			continue;
+
+		load = 0;
+		list_for_each_entry(other, &tx2_pmus, entry) {
+			if (other != tx2_pmu && other->cpu == cpu)
+				load++;
+		}
+		if (load < best_load) {
+			best = cpu;
+			best_load = load;
+		}
+	}
+
+	return best < nr_cpu_ids ? best : fallback;
+}
+
+/*
+ * Move the events of a PMU to another CPU. The PMU stays with the
+ * sampling engine of its node, which does not follow the PMU's CPU.
+ */
+static void tx2_uncore_pmu_migrate(struct tx2_uncore_pmu *tx2_pmu,
+		unsigned int new_cpu)
+{
+	unsigned int old_cpu = tx2_pmu->cpu;
+
+	tx2_pmu->cpu = new_cpu;
+	if (new_cpu >= nr_cpu_ids)
+		return;
+
+	perf_pmu_migrate_context(&tx2_pmu->pmu, old_cpu, new_cpu);
+}
+
+/*
+ * sysfs cpumask attributes, writing a CPU of the PMU's node moves the
+ * PMU to it
  */
 static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr,
 		char *buf)
 {
 	struct tx2_uncore_pmu *tx2_pmu;
+	unsigned int cpu;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	cpu = READ_ONCE(tx2_pmu->cpu);
+	return cpumap_print_to_pagebuf(true, buf,
+			cpu < nr_cpu_ids ? cpumask_of(cpu) : cpu_none_mask);
+}
+
+static ssize_t cpumask_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	unsigned int cpu;
+	int ret;
 
 	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
-	return cpumap_print_to_pagebuf(true, buf, cpumask_of(tx2_pmu->cpu));
+	ret = kstrtouint(buf, 0, &cpu);
+	if (ret)
+		return ret;
+
+	if (cpu >= nr_cpu_ids ||
+	    !cpumask_test_cpu(cpu, tx2_uncore_pmu_cpus(tx2_pmu)))
+		return -EINVAL;
+
+	cpus_read_lock();
+	mutex_lock(&tx2_pmus_lock);
+	if (!cpu_online(cpu))
+		ret = -ENODEV;
+	else if (cpu != tx2_pmu->cpu)
+		tx2_uncore_pmu_migrate(tx2_pmu, cpu);
+	mutex_unlock(&tx2_pmus_lock);
+	cpus_read_unlock();
+
+	return ret ? ret : count;
 }
-static DEVICE_ATTR_RO(cpumask);
+static DEVICE_ATTR_RW(cpumask);
 
 static struct attribute *tx2_pmu_cpumask_attrs[] = {
 	&dev_attr_cpumask.attr,
@@ -355,280 +660,2100 @@ static const struct attribute_group pmu_cpumask_attr_group = {
 };
 
 /*
- * Per PMU device attribute groups
+ * sysfs hrtimer interval bounds, in milliseconds
  */
-static const struct attribute_group *smmu_pmu_attr_groups[] = {
-	&smmu_pmu_format_attr_group,
-	&pmu_cpumask_attr_group,
-	&smmu_pmu_events_attr_group,
-	NULL
-};
-
-static inline u32 reg_readl(unsigned long addr)
+static ssize_t hrtimer_min_interval_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	return readl((void __iomem *)addr);
-}
+	struct tx2_uncore_pmu *tx2_pmu;
 
-static inline void reg_writel(u32 val, unsigned long addr)
-{
-	writel(val, (void __iomem *)addr);
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->hrtimer_min_interval) / NSEC_PER_MSEC);
 }
 
-static int alloc_counter(struct tx2_uncore_pmu *tx2_pmu)
+static ssize_t hrtimer_min_interval_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	int counter;
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
 
-	counter = find_first_zero_bit(tx2_pmu->active_counters,
-				tx2_pmu->max_counters);
-	if (counter == tx2_pmu->max_counters)
-		return -ENOSPC;
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	set_bit(counter, tx2_pmu->active_counters);
-	return counter;
-}
+	if (!val || val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_MSEC)
+		return -EINVAL;
+	val *= NSEC_PER_MSEC;
 
-static inline void free_counter(struct tx2_uncore_pmu *tx2_pmu, int counter)
-{
-	clear_bit(counter, tx2_pmu->active_counters);
+	/* min and max are checked against each other under the lock */
+	mutex_lock(&tx2_pmus_lock);
+	if (val > tx2_pmu->hrtimer_max_interval)
+		ret = -EINVAL;
+	else
+		WRITE_ONCE(tx2_pmu->hrtimer_min_interval, val);
+	mutex_unlock(&tx2_pmus_lock);
+
+	return ret ? ret : count;
 }
+static DEVICE_ATTR_RW(hrtimer_min_interval_ms);
 
-static bool is_event_64bit(struct perf_event *event)
+static ssize_t hrtimer_max_interval_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
+	struct tx2_uncore_pmu *tx2_pmu;
 
-	switch (GET_EVENTID(event)) {
-	case SMMU_PERF_EVENT_NUM_CYCLES :
-	case SMMU_PERF_EVENT_ARID_CONT_CACHE_HIT :
-	case SMMU_PERF_EVENT_ARID_CONT_CACHE_MISS :
-	case SMMU_PERF_EVENT_ARID_CACHE_HIT :
-	case SMMU_PERF_EVENT_ARID_CACHE_MISS :
-	case SMMU_PERF_EVENT_MAIN_TLB_HIT :
-	case SMMU_PERF_EVENT_MAIN_TLB_MISS :
-	case SMMU_PERF_EVENT_PWC_HIT :
-	case SMMU_PERF_EVENT_PWC_MISS :
-		return 1;
-	default:
-		return 0;
-	}
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->hrtimer_max_interval) / NSEC_PER_MSEC);
 }
 
-static void tx2_uncore_event_update(struct perf_event *event)
+static ssize_t hrtimer_max_interval_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	s64 new = 0;
-	struct hw_perf_event *hwc = &event->hw;
 	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
 
-	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	new = reg_readl(hwc->event_base);
-	if (is_event_64bit(event))
-		new |=  (u64)reg_readl(hwc->event_base + 4) << 32;
-	local64_add(new , &event->count);
-}
+	if (val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_MSEC)
+		return -EINVAL;
+	val *= NSEC_PER_MSEC;
 
-static bool tx2_uncore_validate_event(struct pmu *pmu,
-				  struct perf_event *event, int *counters)
-{
-	if (is_software_event(event))
-		return true;
-	/* Reject groups spanning multiple HW PMUs. */
-	if (event->pmu != pmu)
-		return false;
+	mutex_lock(&tx2_pmus_lock);
+	if (val < tx2_pmu->hrtimer_min_interval)
+		ret = -EINVAL;
+	else
+		WRITE_ONCE(tx2_pmu->hrtimer_max_interval, val);
+	mutex_unlock(&tx2_pmus_lock);
 
-	*counters = *counters + 1;
-	return true;
+	return ret ? ret : count;
 }
+static DEVICE_ATTR_RW(hrtimer_max_interval_ms);
 
 /*
- * Make sure the group of events can be scheduled at once
- * on the PMU.
+ * sysfs read staleness bound, in microseconds. 0 reads the hardware on
+ * every event read.
  */
-static bool tx2_uncore_validate_event_group(struct perf_event *event)
+static ssize_t read_staleness_us_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct perf_event *sibling, *leader = event->group_leader;
-	int counters = 0;
 	struct tx2_uncore_pmu *tx2_pmu;
 
-	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
-
-	if (event->group_leader == event)
-		return true;
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->read_staleness) / NSEC_PER_USEC);
+}
 
-	if (!tx2_uncore_validate_event(event->pmu, leader, &counters))
-		return false;
+static ssize_t read_staleness_us_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
 
-	for_each_sibling_event(sibling, leader) {
-		if (!tx2_uncore_validate_event(event->pmu, sibling, &counters))
-			return false;
-	}
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	if (!tx2_uncore_validate_event(event->pmu, event, &counters))
-		return false;
+	if (val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_USEC)
+		return -EINVAL;
 
-	/*
-	 * If the group requires more counters than the HW has,
-	 * it cannot ever be scheduled.
-	 */
-	return counters < tx2_pmu->max_counters;
+	WRITE_ONCE(tx2_pmu->read_staleness, val * NSEC_PER_USEC);
+	return count;
 }
+static DEVICE_ATTR_RW(read_staleness_us);
 
-static int tx2_uncore_event_init(struct perf_event *event)
+static ssize_t ring_interval_us_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct hw_perf_event *hwc = &event->hw;
 	struct tx2_uncore_pmu *tx2_pmu;
 
-	/*
-	 * SOC PMU counters are shared across all cores.
-	 * Therefore, it does not support per-process mode.
-	 * Also, it does not support event sampling mode.
-	 */
-	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
-		return -EINVAL;
-
-	/* We have no filtering of any kind */
-	if (event->attr.exclude_user	||
-	    event->attr.exclude_kernel	||
-	    event->attr.exclude_hv	||
-	    event->attr.exclude_idle	||
-	    event->attr.exclude_host	||
-	    event->attr.exclude_guest)
-		return -EINVAL;
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->ring_interval) / NSEC_PER_USEC);
+}
 
-	if (event->cpu < 0)
-		return -EINVAL;
+static ssize_t ring_interval_us_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
 
-	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
-	if (tx2_pmu->cpu >= nr_cpu_ids)
-		return -EINVAL;
-	event->cpu = tx2_pmu->cpu;
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	if (event->attr.config >= tx2_pmu->max_events)
+	if (val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_USEC)
 		return -EINVAL;
-
-	/* store event id */
-	hwc->config = event->attr.config;
-
-	/* Validate the group */
-	if (!tx2_uncore_validate_event_group(event))
+	val *= NSEC_PER_USEC;
+	if (val < TX2_PMU_RING_MIN_INTERVAL)
 		return -EINVAL;
 
-	return 0;
+	WRITE_ONCE(tx2_pmu->ring_interval, val);
+	return count;
 }
+static DEVICE_ATTR_RW(ring_interval_us);
 
-static void tx2_uncore_event_start(struct perf_event *event, int flags)
+static void tx2_uncore_sweep(struct tx2_uncore_pmu *tx2_pmu);
+
+/*
+ * With always_on, every counter is enabled from module load on and the
+ * totals are cumulative. The sampling engine keeps them from wrapping,
+ * reads follow read_staleness like perf reads do.
+ */
+static ssize_t totals_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
 {
-	struct hw_perf_event *hwc = &event->hw;
 	struct tx2_uncore_pmu *tx2_pmu;
+	u64 staleness;
+	ssize_t len = 0;
+	int idx;
 
-	hwc->state = 0;
-	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	staleness = READ_ONCE(tx2_pmu->read_staleness);
+	if (!staleness ||
+	    ktime_get_ns() - smp_load_acquire(&tx2_pmu->sweep_time) >= staleness)
+		tx2_uncore_sweep(tx2_pmu);
+
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n",
+				 smmu_event_name[idx],
+				 (u64)atomic64_read(&tx2_pmu->counters[idx].total));
+	return len;
+}
+static DEVICE_ATTR_RO(totals);
 
-	reg_writel(0xfffffc07, hwc->config_base);
-	local64_set(&event->hw.prev_count, 0ULL);
+static int tx2_uncore_threshold_set(struct tx2_uncore_pmu *tx2_pmu, int idx,
+		u64 threshold);
 
-	perf_event_update_userpage(event);
+/*
+ * Rate thresholds in events per second, one file per event under
+ * thresholds/, 0 is off. A threshold keeps its counter enabled, and is
+ * checked by the sampling engine at least every hrtimer_min_interval_ms.
+ */
+static ssize_t threshold_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	struct dev_ext_attribute *eattr;
 
-	/* Start timer for first event */
-	if (bitmap_weight(tx2_pmu->active_counters,
-				tx2_pmu->max_counters) == 1) {
-		hrtimer_start(&tx2_pmu->hrtimer,
-			ns_to_ktime(tx2_pmu->hrtimer_interval),
-			HRTIMER_MODE_REL_PINNED);
-	}
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	eattr = container_of(attr, struct dev_ext_attribute, attr);
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->thresholds[(unsigned long)eattr->var]));
 }
 
-static void tx2_uncore_event_stop(struct perf_event *event, int flags)
+static ssize_t threshold_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	struct hw_perf_event *hwc = &event->hw;
 	struct tx2_uncore_pmu *tx2_pmu;
+	struct dev_ext_attribute *eattr;
+	u64 val;
+	int ret;
 
-	if (hwc->state & PERF_HES_UPTODATE)
-		return;
-
-	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
-
-	/* select, disable and stop counter */
-	reg_writel(0, hwc->config_base);
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	eattr = container_of(attr, struct dev_ext_attribute, attr);
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	WARN_ON_ONCE(hwc->state & PERF_HES_STOPPED);
-	hwc->state |= PERF_HES_STOPPED;
-	if (flags & PERF_EF_UPDATE) {
-		tx2_uncore_event_update(event);
-		hwc->state |= PERF_HES_UPTODATE;
-	}
+	ret = tx2_uncore_threshold_set(tx2_pmu, (unsigned long)eattr->var, val);
+	return ret ? ret : count;
 }
 
-static int tx2_uncore_event_add(struct perf_event *event, int flags)
+#define SMMU_THRESHOLD_ATTR(id, reg, width, name)			\
+	static struct dev_ext_attribute tx2_pmu_threshold_attr_##name = {	\
+		__ATTR(name, 0644, threshold_show, threshold_store),	\
+		(void *)SMMU_PERF_EVENT_##id				\
+	};
+SMMU_PERF_EVENTS(SMMU_THRESHOLD_ATTR)
+
+/*
+ * The events currently above their threshold. Pollable: a change is
+ * signalled with sysfs_notify(), and with a KOBJ_CHANGE uevent.
+ */
+static ssize_t alert_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
 {
-	struct hw_perf_event *hwc = &event->hw;
 	struct tx2_uncore_pmu *tx2_pmu;
+	unsigned long alerts;
+	ssize_t len = 0;
+	int idx;
 
-	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	alerts = READ_ONCE(tx2_pmu->alerts);
+	for_each_set_bit(idx, &alerts, SMMU_PERF_EVENT_MAX)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%s",
+				 len ? " " : "", smmu_event_name[idx]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+static DEVICE_ATTR_RO(alert);
 
-	/* Allocate a free counter */
-	hwc->idx  = alloc_counter(tx2_pmu);
-	if (hwc->idx < 0)
-		return -EAGAIN;
+#define SMMU_THRESHOLD_ATTR_PTR(id, reg, width, name)	\
+	&tx2_pmu_threshold_attr_##name.attr.attr,
+static struct attribute *tx2_pmu_threshold_attrs[] = {
+	SMMU_PERF_EVENTS(SMMU_THRESHOLD_ATTR_PTR)
+	&dev_attr_alert.attr,
+	NULL,
+};
 
-	tx2_pmu->events[hwc->idx] = event;
-	/* set counter control and data registers base address */
-	hwc->config_base = (unsigned long)tx2_pmu->base +
-		SMMU_PERF_CTL * 4;
-	hwc->event_base =  (unsigned long)tx2_pmu->base +
-		smmu_event_hw_offset[GET_EVENTID(event)] * 4;
+static const struct attribute_group pmu_threshold_attr_group = {
+	.name = "thresholds",
+	.attrs = tx2_pmu_threshold_attrs,
+};
 
-	hwc->state = PERF_HES_UPTODATE | PERF_HES_STOPPED;
-	if (flags & PERF_EF_START)
-		tx2_uncore_event_start(event, flags);
+static int tx2_uncore_recorder_arm(struct tx2_uncore_pmu *tx2_pmu);
+static void tx2_uncore_recorder_off(struct tx2_uncore_pmu *tx2_pmu);
 
-	return 0;
+/*
+ * Flight recorder: while armed, it appends a snapshot of all counters
+ * to a circular history every interval_ms, kept within the hrtimer
+ * interval bounds of the PMU. When an
+ * event goes above its threshold it samples every fast_interval_us for
+ * post_trigger_ms more, then freezes the history until re-armed.
+ */
+static ssize_t enable_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%d\n",
+		READ_ONCE(tx2_pmu->recorder_state) != TX2_RECORDER_OFF);
 }
 
-static void tx2_uncore_event_del(struct perf_event *event, int flags)
+/* Writing 1 (re)arms the recorder and discards the history */
+static ssize_t enable_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
 {
-	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(event->pmu);
-	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+	bool enable;
+	int ret;
 
-	tx2_uncore_event_stop(event, PERF_EF_UPDATE);
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
 
-	/* clear the assigned counter */
-	free_counter(tx2_pmu, GET_COUNTERID(event));
+	if (enable)
+		ret = tx2_uncore_recorder_arm(tx2_pmu);
+	else
+		tx2_uncore_recorder_off(tx2_pmu);
 
-	perf_event_update_userpage(event);
-	tx2_pmu->events[hwc->idx] = NULL;
-	hwc->idx = -1;
+	return ret ? ret : count;
 }
+static DEVICE_ATTR_RW(enable);
 
-static void tx2_uncore_event_read(struct perf_event *event)
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
 {
-	tx2_uncore_event_update(event);
-}
+	struct tx2_uncore_pmu *tx2_pmu;
 
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%s\n",
+		tx2_recorder_state_name[READ_ONCE(tx2_pmu->recorder_state)]);
+}
+static DEVICE_ATTR_RO(state);
+
+static ssize_t trigger_ns_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->recorder_trigger_time));
+}
+static DEVICE_ATTR_RO(trigger_ns);
+
+static ssize_t interval_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->recorder_interval) / NSEC_PER_MSEC);
+}
+
+static ssize_t interval_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (!val || val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_MSEC)
+		return -EINVAL;
+
+	WRITE_ONCE(tx2_pmu->recorder_interval, val * NSEC_PER_MSEC);
+	return count;
+}
+static DEVICE_ATTR_RW(interval_ms);
+
+static ssize_t fast_interval_us_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->recorder_fast_interval) / NSEC_PER_USEC);
+}
+
+static ssize_t fast_interval_us_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_USEC)
+		return -EINVAL;
+	val *= NSEC_PER_USEC;
+	if (val < TX2_PMU_RING_MIN_INTERVAL)
+		return -EINVAL;
+
+	WRITE_ONCE(tx2_pmu->recorder_fast_interval, val);
+	return count;
+}
+static DEVICE_ATTR_RW(fast_interval_us);
+
+static ssize_t post_trigger_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	return sprintf(buf, "%llu\n",
+		READ_ONCE(tx2_pmu->recorder_post) / NSEC_PER_MSEC);
+}
+
+static ssize_t post_trigger_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 val;
+	int ret;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(dev));
+	ret = kstrtou64(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > TX2_PMU_HRTIMER_LIMIT / NSEC_PER_MSEC)
+		return -EINVAL;
+
+	WRITE_ONCE(tx2_pmu->recorder_post, val * NSEC_PER_MSEC);
+	return count;
+}
+static DEVICE_ATTR_RW(post_trigger_ms);
+
+/*
+ * The frozen history, oldest record first, in the record format of the
+ * snapshot ring. Only readable once frozen, so it cannot change under
+ * a reader.
+ */
+static ssize_t history_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	size_t size = sizeof(struct tx2_smmu_ring_record);
+	u64 nr, first, idx;
+	size_t done, len;
+	ssize_t ret;
+	u32 within;
+
+	tx2_pmu = pmu_to_tx2_pmu(dev_get_drvdata(kobj_to_dev(kobj)));
+
+	mutex_lock(&tx2_pmu->recorder_lock);
+	if (tx2_pmu->recorder_state != TX2_RECORDER_FROZEN) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	nr = min_t(u64, tx2_pmu->recorder_head, TX2_PMU_RECORDER_RECORDS);
+	first = tx2_pmu->recorder_head - nr;
+	if (off >= nr * size) {
+		ret = 0;
+		goto out;
+	}
+	count = min_t(u64, count, nr * size - off);
+
+	for (done = 0; done < count; done += len) {
+		idx = div_u64_rem(off + done, size, &within);
+		len = min_t(size_t, size - within, count - done);
+		memcpy(buf + done, (void *)&tx2_pmu->recorder[(first + idx) %
+		       TX2_PMU_RECORDER_RECORDS] + within, len);
+	}
+	ret = count;
+out:
+	mutex_unlock(&tx2_pmu->recorder_lock);
+	return ret;
+}
+static BIN_ATTR_RO(history, 0);
+
+static struct attribute *tx2_pmu_recorder_attrs[] = {
+	&dev_attr_enable.attr,
+	&dev_attr_state.attr,
+	&dev_attr_trigger_ns.attr,
+	&dev_attr_interval_ms.attr,
+	&dev_attr_fast_interval_us.attr,
+	&dev_attr_post_trigger_ms.attr,
+	NULL,
+};
+
+static struct bin_attribute *tx2_pmu_recorder_bin_attrs[] = {
+	&bin_attr_history,
+	NULL,
+};
+
+static const struct attribute_group pmu_recorder_attr_group = {
+	.name = "recorder",
+	.attrs = tx2_pmu_recorder_attrs,
+	.bin_attrs = tx2_pmu_recorder_bin_attrs,
+};
+
+static struct attribute *tx2_pmu_sampling_attrs[] = {
+	&dev_attr_hrtimer_min_interval_ms.attr,
+	&dev_attr_hrtimer_max_interval_ms.attr,
+	&dev_attr_read_staleness_us.attr,
+	&dev_attr_ring_interval_us.attr,
+	&dev_attr_totals.attr,
+	NULL,
+};
+
+static const struct attribute_group pmu_sampling_attr_group = {
+	.attrs = tx2_pmu_sampling_attrs,
+};
+
+/*
+ * Per PMU device attribute groups
+ */
+static const struct attribute_group *smmu_pmu_attr_groups[] = {
+	&smmu_pmu_format_attr_group,
+	&pmu_cpumask_attr_group,
+	&pmu_sampling_attr_group,
+	&pmu_threshold_attr_group,
+	&pmu_recorder_attr_group,
+	&smmu_pmu_events_attr_group,
+	NULL
+};
+
+/* Aggregate PMUs count unfiltered and sample through their members */
+static struct attribute *smmu_agg_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL,
+};
+
+static const struct attribute_group smmu_agg_format_attr_group = {
+	.name = "format",
+	.attrs = smmu_agg_format_attrs,
+};
+
+static const struct attribute_group *smmu_agg_attr_groups[] = {
+	&smmu_agg_format_attr_group,
+	&pmu_cpumask_attr_group,
+	&smmu_pmu_events_attr_group,
+	NULL
+};
+
+static inline u64 tx2_uncore_mmio_begin(void)
+{
+	return READ_ONCE(mmio_timing) ? local_clock() : 0;
+}
+
+static void tx2_uncore_mmio_end(struct tx2_uncore_pmu *tx2_pmu, u64 start)
+{
+	u64 ns;
+	int bucket;
+
+	this_cpu_inc(tx2_pmu->stats->mmio_reads);
+	if (!start)
+		return;
+
+	ns = local_clock() - start;
+	bucket = ns ? min_t(int, ilog2(ns), TX2_SMMU_STATS_LAT_BUCKETS - 1) : 0;
+	this_cpu_inc(tx2_pmu->stats->read_lat[bucket]);
+}
+
+static inline u32 reg_readl(struct tx2_uncore_pmu *tx2_pmu,
+		unsigned long addr)
+{
+	u64 start = tx2_uncore_mmio_begin();
+	u32 val = readl((void __iomem *)addr);
+
+	tx2_uncore_mmio_end(tx2_pmu, start);
+	return val;
+}
+
+static inline u64 reg_readq(struct tx2_uncore_pmu *tx2_pmu,
+		unsigned long addr)
+{
+	u64 start = tx2_uncore_mmio_begin();
+	u64 val = readq((void __iomem *)addr);
+
+	tx2_uncore_mmio_end(tx2_pmu, start);
+	return val;
+}
+
+static inline void reg_writel(struct tx2_uncore_pmu *tx2_pmu, u32 val,
+		unsigned long addr)
+{
+	this_cpu_inc(tx2_pmu->stats->mmio_writes);
+	writel(val, (void __iomem *)addr);
+}
+
+/*
+ * Counting is switched on for the first counter allocated and off with
+ * the last one, so an idle SMMU does not count, whatever the firmware
+ * left in the control register.
+ */
+static void tx2_uncore_write_ctl(struct tx2_uncore_pmu *tx2_pmu, u32 val)
+{
+	reg_writel(tx2_pmu, val,
+		   (unsigned long)tx2_pmu->base + SMMU_PERF_CTL * 4);
+}
+
+static inline u32 counter_width(int counter)
+{
+	return smmu_event_width[counter];
+}
+
+static inline unsigned long counter_addr(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	return (unsigned long)tx2_pmu->base +
+		smmu_event_hw_offset[counter] * 4;
+}
+
+/*
+ * A 64-bit counter is a pair of 32-bit registers. Read it with a single
+ * 64-bit access when the SMMU allows it, otherwise read the high word
+ * around the low word and retry if a carry got in between.
+ */
+static u64 tx2_uncore_counter_read_hw(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	unsigned long addr = counter_addr(tx2_pmu, counter);
+	u32 hi, lo;
+
+	if (counter_width(counter) == 32)
+		return reg_readl(tx2_pmu, addr);
+
+	if (tx2_pmu->mmio64)
+		return reg_readq(tx2_pmu, addr);
+
+	do {
+		hi = reg_readl(tx2_pmu, addr + 4);
+		lo = reg_readl(tx2_pmu, addr);
+	} while (reg_readl(tx2_pmu, addr + 4) != hi);
+
+	return (u64)hi << 32 | lo;
+}
+
+/*
+ * Every event has exactly one hardware counter, so the counter is
+ * selected by the event id and shared by all the perf events counting
+ * that event. The first user snapshots the current hardware value,
+ * later users only take a reference. The SMMU counts while any counter
+ * has a user; enabling it may restart the counters, so it is enabled
+ * before the snapshot.
+ */
+static int alloc_counter(struct tx2_uncore_pmu *tx2_pmu, int counter)
+{
+	struct tx2_smmu_counter *cnt;
+
+	if (counter >= tx2_pmu->max_counters)
+		return -ENOSPC;
+
+	cnt = &tx2_pmu->counters[counter];
+	if (cnt->refcnt++ == 0) {
+		if (bitmap_empty(tx2_pmu->active_counters,
+				 tx2_pmu->max_counters))
+			tx2_uncore_write_ctl(tx2_pmu, SMMU_PERF_CTL_ENABLE);
+		atomic64_set(&cnt->prev,
+			    tx2_uncore_counter_read_hw(tx2_pmu, counter));
+		cnt->rate_total = atomic64_read(&cnt->total);
+		set_bit(counter, tx2_pmu->active_counters);
+	}
+	return counter;
+}
+
+static inline void free_counter(struct tx2_uncore_pmu *tx2_pmu, int counter)
+{
+	if (--tx2_pmu->counters[counter].refcnt)
+		return;
+
+	clear_bit(counter, tx2_pmu->active_counters);
+	if (bitmap_empty(tx2_pmu->active_counters, tx2_pmu->max_counters))
+		tx2_uncore_write_ctl(tx2_pmu, 0);
+}
+
+/*
+ * Accumulate the difference between the current hardware value and the
+ * value seen by the previous update into the 64-bit total of the counter.
+ * The 32-bit counters are extended to 64 bits in software, which is safe
+ * as long as they are sampled at least once per wrap period (the sampling
+ * engine guarantees that).
+ */
+static u64 tx2_uncore_counter_update(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	struct tx2_smmu_counter *cnt = &tx2_pmu->counters[counter];
+	u64 prev, new, delta, mask;
+
+	mask = GENMASK_ULL(counter_width(counter) - 1, 0);
+
+	do {
+		prev = atomic64_read(&cnt->prev);
+		new = tx2_uncore_counter_read_hw(tx2_pmu, counter);
+	} while (atomic64_cmpxchg(&cnt->prev, prev, new) != prev);
+
+	if (new < prev)
+		trace_tx2_smmu_counter_wrap(tx2_pmu->name, counter, prev, new);
+
+	delta = (new - prev) & mask;
+	atomic64_add(delta, &cnt->total);
+	return delta;
+}
+
+/*
+ * Each perf event keeps its own baseline of the shared counter total in
+ * hw.prev_count, so any number of sessions can count the same event.
+ */
+static void tx2_uncore_event_fold_total(struct perf_event *event, u64 new)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	u64 prev;
+
+	do {
+		prev = local64_read(&hwc->prev_count);
+		/* a concurrent reader folded a later total already */
+		if ((s64)(new - prev) <= 0)
+			return;
+	} while (local64_cmpxchg(&hwc->prev_count, prev, new) != prev);
+
+	local64_add(new - prev, &event->count);
+}
+
+static void tx2_uncore_event_fold(struct perf_event *event)
+{
+	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+
+	tx2_uncore_event_fold_total(event,
+		atomic64_read(&tx2_pmu->counters[GET_COUNTERID(event)].total));
+}
+
+static void tx2_uncore_event_update(struct perf_event *event)
+{
+	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+
+	tx2_uncore_counter_update(tx2_pmu, GET_COUNTERID(event));
+	tx2_uncore_event_fold(event);
+}
+
+/*
+ * The counters are free running while they have users and are never
+ * restarted, so all accounting is done from snapshots. Fold every active
+ * counter into its total in one sequential pass. This has to happen once
+ * per wrap period of the 32-bit counters, and the totals double as a
+ * cache for reads that can live with slightly stale counts.
+ */
+static void tx2_uncore_sweep(struct tx2_uncore_pmu *tx2_pmu)
+{
+	u64 delta;
+	int idx;
+
+	for_each_set_bit(idx, tx2_pmu->active_counters, tx2_pmu->max_counters) {
+		delta = tx2_uncore_counter_update(tx2_pmu, idx);
+		trace_tx2_smmu_counter_delta(tx2_pmu->name, idx, delta,
+			atomic64_read(&tx2_pmu->counters[idx].total));
+	}
+
+	/* publish the totals before the time of the sweep */
+	smp_store_release(&tx2_pmu->sweep_time, ktime_get_ns());
+}
+
+/* Events per second, for delta events counted over elapsed ns */
+static inline u64 tx2_uncore_rate(u64 delta, u64 elapsed)
+{
+	return mul_u64_u64_div_u64(delta, NSEC_PER_SEC, elapsed);
+}
+
+/*
+ * Record the highest rate seen on a 32-bit counter since the previous
+ * call, for tx2_uncore_next_interval().
+ */
+static void tx2_uncore_update_rate(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_counter *cnt;
+	u64 total, max_delta = 0;
+	ktime_t now = ktime_get();
+	s64 elapsed;
+	bool narrow = false;
+	int idx;
+
+	for_each_set_bit(idx, tx2_pmu->active_counters, tx2_pmu->max_counters) {
+		if (counter_width(idx) != 32)
+			continue;
+		cnt = &tx2_pmu->counters[idx];
+		total = atomic64_read(&cnt->total);
+		narrow = true;
+		max_delta = max(max_delta, total - cnt->rate_total);
+		cnt->rate_total = total;
+	}
+
+	elapsed = ktime_to_ns(ktime_sub(now, tx2_pmu->rate_stamp));
+	if (elapsed > 0)
+		tx2_pmu->narrow_rate = tx2_uncore_rate(max_delta, elapsed);
+	tx2_pmu->narrow_active = narrow;
+	tx2_pmu->rate_stamp = now;
+}
+
+static inline u32 tx2_uncore_event_filter(struct perf_event *event)
+{
+	return GET_FILTER(event);
+}
+
+static struct tx2_uncore_pmu *tx2_uncore_find_pmu(
+		struct fwnode_handle *fwnode)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+		if (fwnode && tx2_pmu->smmu && tx2_pmu->smmu->fwnode == fwnode)
+			return tx2_pmu;
+	}
+	return NULL;
+}
+
+/*
+ * Translate the PCI device selected in config2 into the stream ID it
+ * uses on this SMMU, from the IOMMU firmware mapping (IORT or DT).
+ */
+static int tx2_uncore_pci_arid(struct tx2_uncore_pmu *tx2_pmu,
+		struct perf_event *event, u32 *arid)
+{
+	struct tx2_uncore_pmu *owner;
+	struct iommu_fwspec *fwspec;
+	struct pci_dev *pdev;
+	int ret = -ENODEV;
+
+	pdev = pci_get_domain_bus_and_slot(GET_PCI_SEG(event),
+					   GET_PCI_BUS(event),
+					   GET_PCI_DEVFN(event));
+	if (!pdev)
+		return -ENODEV;
+
+	fwspec = dev_iommu_fwspec_get(&pdev->dev);
+	if (!fwspec || !fwspec->num_ids)
+		goto out;
+
+	owner = tx2_uncore_find_pmu(fwspec->iommu_fwnode);
+	if (owner != tx2_pmu) {
+		pr_debug("%s: %s is not behind this SMMU (use %s)\n",
+			 tx2_pmu->name, pci_name(pdev),
+			 owner ? owner->name : "none");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * The filter takes a single 16-bit ARID. A device with several
+	 * stream IDs, or one wider than the filter, cannot be selected.
+	 */
+	if (fwspec->num_ids != 1 || fwspec->ids[0] > 0xffff) {
+		pr_debug("%s: %s has %u stream IDs, first 0x%x, cannot filter\n",
+			 tx2_pmu->name, pci_name(pdev), fwspec->num_ids,
+			 fwspec->ids[0]);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	*arid = fwspec->ids[0];
+	ret = 0;
+out:
+	pci_dev_put(pdev);
+	return ret;
+}
+
+/*
+ * Work out the SMMU_PERF_FILTER_ARID value requested by an event, either
+ * from a raw ARID in config1 or from a PCI device in config2. Once any
+ * filter field is given, no mask asks for an exact match; the filter bit
+ * alone selects ARID 0, which perf cannot tell from no filter.
+ */
+static int tx2_uncore_config_filter(struct tx2_uncore_pmu *tx2_pmu,
+		struct perf_event *event, u32 *filter)
+{
+	u32 arid = GET_ARID(event), mask = GET_ARID_MASK(event);
+	int ret;
+
+	if (!event->attr.config1 && !event->attr.config2) {
+		*filter = 0;
+		return 0;
+	}
+
+	if (event->attr.config2) {
+		if (GET_ARID(event) || GET_ARID_MASK(event))
+			return -EINVAL;
+
+		ret = tx2_uncore_pci_arid(tx2_pmu, event, &arid);
+		if (ret)
+			return ret;
+	}
+
+	if (!mask)
+		mask = 0xffff;
+
+	*filter = arid << SMMU_PERF_FILTER_ARID_SHIFT |
+		mask << SMMU_PERF_FILTER_MASK_SHIFT;
+	return 0;
+}
+
+/*
+ * The ARID filter applies to all counters of the SMMU, so every event
+ * counting at the same time has to ask for the same filter. Without a
+ * filter user it is cleared, as always_on, thresholds, the recorder and
+ * the ring count without taking one.
+ */
+static int tx2_uncore_get_filter(struct tx2_uncore_pmu *tx2_pmu, u32 filter)
+{
+	if (tx2_pmu->filter_users && tx2_pmu->filter != filter)
+		return -EBUSY;
+
+	if (tx2_pmu->filter_users++ == 0 && tx2_pmu->filter != filter) {
+		tx2_pmu->filter = filter;
+		reg_writel(tx2_pmu, filter, (unsigned long)tx2_pmu->base +
+			   SMMU_PERF_FILTER_ARID * 4);
+	}
+	return 0;
+}
+
+static inline void tx2_uncore_put_filter(struct tx2_uncore_pmu *tx2_pmu)
+{
+	if (--tx2_pmu->filter_users == 0 && tx2_pmu->filter) {
+		tx2_pmu->filter = 0;
+		reg_writel(tx2_pmu, 0, (unsigned long)tx2_pmu->base +
+			   SMMU_PERF_FILTER_ARID * 4);
+	}
+}
+
+static bool tx2_uncore_validate_event(struct pmu *pmu,
+				  struct perf_event *event,
+				  unsigned long *counters, u32 filter)
+{
+	if (is_software_event(event))
+		return true;
+	/* Reject groups spanning multiple HW PMUs. */
+	if (event->pmu != pmu)
+		return false;
+
+	/* Reject groups that can never count at the same time */
+	if (tx2_uncore_event_filter(event) != filter)
+		return false;
+
+	/* Events counting the same event share its counter */
+	__set_bit(GET_EVENTID(event), counters);
+	return true;
+}
+
+/*
+ * Make sure the group of events can be scheduled at once
+ * on the PMU.
+ */
+static bool tx2_uncore_validate_event_group(struct perf_event *event)
+{
+	struct perf_event *sibling, *leader = event->group_leader;
+	DECLARE_BITMAP(counters, SMMU_PERF_EVENT_MAX) = { 0 };
+	u32 filter = tx2_uncore_event_filter(event);
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+
+	if (event->group_leader == event)
+		return true;
+
+	if (!tx2_uncore_validate_event(event->pmu, leader, counters, filter))
+		return false;
+
+	for_each_sibling_event(sibling, leader) {
+		if (!tx2_uncore_validate_event(event->pmu, sibling, counters,
+					       filter))
+			return false;
+	}
+
+	if (!tx2_uncore_validate_event(event->pmu, event, counters, filter))
+		return false;
+
+	/*
+	 * If the group requires more counters than the HW has,
+	 * it cannot ever be scheduled.
+	 */
+	return bitmap_weight(counters, SMMU_PERF_EVENT_MAX) <=
+		tx2_pmu->max_counters;
+}
+static int tx2_uncore_event_init(struct perf_event *event)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+	u32 filter;
+	int ret;
+
+	/*
+	 * SOC PMU counters are shared across all cores.
+	 * Therefore, it does not support per-process mode.
+	 */
+	if (event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+
+	/* We have no privilege level filtering */
+	if (event->attr.exclude_user	||
+	    event->attr.exclude_kernel	||
+	    event->attr.exclude_hv	||
+	    event->attr.exclude_idle	||
+	    event->attr.exclude_host	||
+	    event->attr.exclude_guest)
+		return -EINVAL;
+
+	if (event->cpu < 0)
+		return -EINVAL;
+
+	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+	if (tx2_pmu->cpu >= nr_cpu_ids)
+		return -EINVAL;
+	event->cpu = tx2_pmu->cpu;
+
+	/* Sampling is emulated per SMMU, see tx2_uncore_sample_callback() */
+	if (is_sampling_event(event) && !tx2_pmu->smmu)
+		return -EINVAL;
+
+	/*
+	 * The counters are MMIO, so any CPU of the package can read them
+	 * without an IPI to the CPU the event is scheduled on.
+	 */
+	event->event_caps |= PERF_EV_CAP_READ_ACTIVE_PKG;
+
+	if (event->attr.config >= tx2_pmu->max_events)
+		return -EINVAL;
+
+	/* Only the ARID filter is defined in config1 and config2 */
+	if (event->attr.config1 >> 33 || event->attr.config2 >> 32)
+		return -EINVAL;
+
+	/* ARIDs are local to an SMMU, aggregates cannot filter */
+	if (!tx2_pmu->smmu && (event->attr.config1 || event->attr.config2))
+		return -EINVAL;
+
+	ret = tx2_uncore_config_filter(tx2_pmu, event, &filter);
+	if (ret)
+		return ret;
+
+	/* store event id and filter */
+	hwc->config = event->attr.config | (u64)filter << 32;
+
+	/* Validate the group */
+	if (!tx2_uncore_validate_event_group(event))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Record spacing of an armed flight recorder, within the timer bounds */
+static u64 tx2_uncore_recorder_interval(struct tx2_uncore_pmu *tx2_pmu)
+{
+	return clamp(READ_ONCE(tx2_pmu->recorder_interval),
+		     READ_ONCE(tx2_pmu->hrtimer_min_interval),
+		     READ_ONCE(tx2_pmu->hrtimer_max_interval));
+}
+
+/*
+ * Pick the next sampling interval: as long as possible, but short enough
+ * that the busiest 32-bit counter cannot wrap twice between two samples.
+ * Counters that are 64 bits wide never wrap in practice.
+ */
+
+static u64 tx2_uncore_next_interval(struct tx2_uncore_pmu *tx2_pmu)
+{
+	u64 min_ns = READ_ONCE(tx2_pmu->hrtimer_min_interval);
+	u64 max_ns = READ_ONCE(tx2_pmu->hrtimer_max_interval);
+	u64 interval = max_ns;
+
+	if (tx2_pmu->narrow_active && tx2_pmu->narrow_rate)
+		interval = div64_u64(BIT_ULL(32) * (NSEC_PER_SEC /
+				TX2_PMU_HRTIMER_HEADROOM), tx2_pmu->narrow_rate);
+
+	interval = clamp(interval, min_ns, max_ns);
+
+	/* An open snapshot ring asks for its own rate */
+	if (tx2_pmu->ring)
+		interval = min(interval, READ_ONCE(tx2_pmu->ring_interval));
+
+	/*
+	 * Rate thresholds are checked as often as sampling allows, except
+	 * while they arm the flight recorder: that keeps to its own rate
+	 * until triggered, then samples faster.
+	 */
+	if (tx2_pmu->recorder_state == TX2_RECORDER_ARMED)
+		interval = min(interval, tx2_uncore_recorder_interval(tx2_pmu));
+	else if (READ_ONCE(tx2_pmu->nr_thresholds))
+		interval = min_ns;
+
+	if (tx2_pmu->recorder_state == TX2_RECORDER_TRIGGERED)
+		interval = min(interval,
+			       READ_ONCE(tx2_pmu->recorder_fast_interval));
+
+	return interval;
+}
+
+/* Snapshot the totals of the active counters, for the ring and recorder */
+static void tx2_uncore_fill_record(struct tx2_uncore_pmu *tx2_pmu,
+		struct tx2_smmu_ring_record *rec)
+{
+	u32 active = 0;
+	int idx;
+
+	rec->time = ktime_get_ns();
+	for_each_set_bit(idx, tx2_pmu->active_counters, tx2_pmu->max_counters) {
+		rec->count[idx] = atomic64_read(&tx2_pmu->counters[idx].total);
+		active |= BIT(idx);
+	}
+	rec->active = active;
+}
+
+/*
+ * Append a snapshot of the active counters to the ring, called by the
+ * engine right after the sweep. Userspace owns tail and can scribble
+ * over the header, so the position and size are kept in the PMU.
+ */
+static void tx2_uncore_ring_write(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_ring_header *hdr = tx2_pmu->ring;
+	struct tx2_smmu_ring_record *rec;
+	u64 head = tx2_pmu->ring_head;
+
+	if (head - READ_ONCE(hdr->tail) >= tx2_pmu->ring_nr) {
+		WRITE_ONCE(hdr->dropped, hdr->dropped + 1);
+		trace_tx2_smmu_ring_drop(tx2_pmu->name, head, hdr->dropped);
+		return;
+	}
+
+	rec = &tx2_pmu->ring_records[do_div(head, tx2_pmu->ring_nr)];
+	tx2_uncore_fill_record(tx2_pmu, rec);
+
+	/* publish the record before the new head */
+	smp_store_release(&hdr->head, ++tx2_pmu->ring_head);
+}
+
+/* Called by the engine right after the sweep, with its lock held */
+static void tx2_uncore_recorder_write(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_ring_record *rec;
+	u64 interval, now;
+
+	if (tx2_pmu->recorder_state != TX2_RECORDER_ARMED &&
+	    tx2_pmu->recorder_state != TX2_RECORDER_TRIGGERED)
+		return;
+
+	/*
+	 * A ring or a busy 32-bit counter may sweep more often than an
+	 * armed recorder records. Keep to a grid of its interval, with the
+	 * same headroom as the timer slack so a slightly early sweep does
+	 * not skip a record.
+	 */
+	if (tx2_pmu->recorder_state == TX2_RECORDER_ARMED) {
+		interval = tx2_uncore_recorder_interval(tx2_pmu);
+		now = ktime_get_ns();
+		if (now + interval / TX2_PMU_HRTIMER_HEADROOM <
+		    tx2_pmu->recorder_next)
+			return;
+		tx2_pmu->recorder_next += interval;
+		if (tx2_pmu->recorder_next <= now)
+			tx2_pmu->recorder_next = now + interval;
+	}
+
+	rec = &tx2_pmu->recorder[tx2_pmu->recorder_head++ %
+				 TX2_PMU_RECORDER_RECORDS];
+	tx2_uncore_fill_record(tx2_pmu, rec);
+
+	if (tx2_pmu->recorder_state == TX2_RECORDER_TRIGGERED &&
+	    rec->time >= tx2_pmu->recorder_freeze_time) {
+		WRITE_ONCE(tx2_pmu->recorder_state, TX2_RECORDER_FROZEN);
+		schedule_work(&tx2_pmu->recorder_work);
+	}
+}
+
+/*
+ * Timer slack lets the engine expire together with other timers of its
+ * CPU instead of waking it up on its own. The interval of a 32-bit
+ * counter already leaves room for the rate to grow, so a share of that
+ * headroom may be given away, as it may for the spacing of the records
+ * of a snapshot ring. With only 64-bit counters active nothing can wrap,
+ * and the timer may be deferred by up to a full interval.
+ */
+static u64 tx2_uncore_engine_slack(struct tx2_smmu_engine *engine)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	list_for_each_entry(tx2_pmu, &engine->pmus, engine_entry) {
+		if (tx2_pmu->narrow_active || tx2_pmu->ring ||
+		    tx2_pmu->recorder_state == TX2_RECORDER_TRIGGERED)
+			return engine->interval / TX2_PMU_HRTIMER_HEADROOM;
+	}
+	return engine->interval;
+}
+
+/* Arm the engine on this CPU, called with the engine lock held */
+static void tx2_uncore_engine_arm(struct tx2_smmu_engine *engine, u64 slack)
+{
+	engine->cpu = smp_processor_id();
+	hrtimer_start_range_ns(&engine->hrtimer, ns_to_ktime(engine->interval),
+			       slack, HRTIMER_MODE_REL_PINNED);
+}
+
+/*
+ * The engine stays on its CPU while that is an online housekeeping CPU
+ * of the node. Otherwise it goes to the CPU servicing the joining PMU,
+ * which tx2_uncore_pick_cpu() chose among those of engine->node; an
+ * event of an aggregate may start it from any CPU.
+ */
+static unsigned int tx2_uncore_engine_cpu(struct tx2_smmu_engine *engine,
+		struct tx2_uncore_pmu *tx2_pmu)
+{
+	unsigned int cpu = engine->cpu;
+
+	if (cpu < nr_cpu_ids && cpu_online(cpu) &&
+	    cpumask_test_cpu(cpu, cpumask_of_node(engine->node)) &&
+	    tx2_uncore_housekeeping_cpu(cpu))
+		return cpu;
+
+	cpu = READ_ONCE(tx2_pmu->cpu);
+	return cpu < nr_cpu_ids ? cpu : smp_processor_id();
+}
+
+/*
+ * Add a PMU to the engine of its node when its first event starts.
+ * Nothing is known about the event rate yet, so sample quickly until
+ * the interval has adapted, and pull the engine in if it is due later.
+ */
+static void tx2_uncore_engine_join(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_engine *engine = tx2_pmu->engine;
+	unsigned long flags;
+	unsigned int cpu;
+	u64 interval;
+
+	interval = READ_ONCE(tx2_pmu->hrtimer_min_interval);
+
+	raw_spin_lock_irqsave(&engine->lock, flags);
+	cpu = tx2_uncore_engine_cpu(engine, tx2_pmu);
+	if (tx2_pmu->ring)
+		interval = min(interval, READ_ONCE(tx2_pmu->ring_interval));
+	tx2_pmu->hrtimer_interval = interval;
+	tx2_pmu->rate_stamp = ktime_get();
+	if (list_empty(&tx2_pmu->engine_entry))
+		list_add_tail(&tx2_pmu->engine_entry, &engine->pmus);
+
+	if (!hrtimer_is_queued(&engine->hrtimer) ||
+	    ktime_to_ns(hrtimer_get_remaining(&engine->hrtimer)) > interval) {
+		if (hrtimer_is_queued(&engine->hrtimer) ||
+		    hrtimer_callback_running(&engine->hrtimer))
+			interval = min(interval, engine->interval);
+		engine->interval = interval;
+		if (cpu == smp_processor_id())
+			tx2_uncore_engine_arm(engine,
+					interval / TX2_PMU_HRTIMER_HEADROOM);
+		else
+			irq_work_queue_on(&engine->kick_work, cpu);
+	}
+	raw_spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+static void tx2_uncore_engine_leave(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_engine *engine = tx2_pmu->engine;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&engine->lock, flags);
+	list_del_init(&tx2_pmu->engine_entry);
+	raw_spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+/*
+ * (Re)start the engine on the calling CPU, via IPI on hotplug and via
+ * kick_work when a PMU joins from another CPU
+ */
+static void tx2_uncore_engine_kick(void *data)
+{
+	struct tx2_smmu_engine *engine = data;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&engine->lock, flags);
+	if (!list_empty(&engine->pmus))
+		tx2_uncore_engine_arm(engine, tx2_uncore_engine_slack(engine));
+	raw_spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+static void tx2_uncore_engine_kick_work(struct irq_work *work)
+{
+	tx2_uncore_engine_kick(container_of(work, struct tx2_smmu_engine,
+					    kick_work));
+}
+
+/*
+ * Compare the rate of every event since the previous sweep with its
+ * threshold. Userspace is told from a work item whenever the set of
+ * events above their threshold changes, in both directions.
+ */
+static void tx2_uncore_check_thresholds(struct tx2_uncore_pmu *tx2_pmu)
+{
+	ktime_t now = ktime_get();
+	unsigned long alerts = 0;
+	u64 total, threshold;
+	s64 elapsed;
+	int idx;
+
+	elapsed = ktime_to_ns(ktime_sub(now, tx2_pmu->threshold_stamp));
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++) {
+		total = atomic64_read(&tx2_pmu->counters[idx].total);
+		threshold = READ_ONCE(tx2_pmu->thresholds[idx]);
+		if (threshold && elapsed > 0 &&
+		    tx2_uncore_rate(total - tx2_pmu->threshold_total[idx],
+				    elapsed) >= threshold)
+			alerts |= BIT(idx);
+		tx2_pmu->threshold_total[idx] = total;
+	}
+	tx2_pmu->threshold_stamp = now;
+
+	/* An event going above its threshold triggers the flight recorder */
+	if ((alerts & ~tx2_pmu->alerts) &&
+	    tx2_pmu->recorder_state == TX2_RECORDER_ARMED) {
+		tx2_pmu->recorder_trigger_time = ktime_to_ns(now);
+		tx2_pmu->recorder_freeze_time = ktime_to_ns(now) +
+			READ_ONCE(tx2_pmu->recorder_post);
+		WRITE_ONCE(tx2_pmu->recorder_state, TX2_RECORDER_TRIGGERED);
+		schedule_work(&tx2_pmu->recorder_work);
+	}
+
+	if (alerts != tx2_pmu->alerts) {
+		WRITE_ONCE(tx2_pmu->alerts, alerts);
+		schedule_work(&tx2_pmu->alert_work);
+	}
+}
+
+/*
+ * Sweep all PMUs of the node in one go. PMUs whose counters are all
+ * released leave the engine, and the engine sleeps once none is left.
+ * The counters are updated atomically, so PMUs serviced by another CPU
+ * of the node can be swept from here.
+ */
 static enum hrtimer_restart tx2_hrtimer_callback(struct hrtimer *timer)
+{
+	struct tx2_uncore_pmu *tx2_pmu, *temp;
+	struct tx2_smmu_engine *engine;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	u64 interval = U64_MAX;
+	u64 start;
+	s64 late;
+
+	engine = container_of(timer, struct tx2_smmu_engine, hrtimer);
+
+	raw_spin_lock(&engine->lock);
+	engine->cpu = smp_processor_id();
+
+	late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+	if (late > (s64)(engine->interval / TX2_PMU_HRTIMER_HEADROOM))
+		trace_tx2_smmu_timer_late(engine->node, engine->cpu, late,
+					  engine->interval);
+
+	list_for_each_entry_safe(tx2_pmu, temp, &engine->pmus, engine_entry) {
+		if (bitmap_empty(tx2_pmu->active_counters,
+				 tx2_pmu->max_counters)) {
+			list_del_init(&tx2_pmu->engine_entry);
+			continue;
+		}
+
+		/* Fold the counts before any 32-bit counter can wrap */
+		start = local_clock();
+		tx2_uncore_sweep(tx2_pmu);
+		tx2_uncore_update_rate(tx2_pmu);
+		tx2_uncore_check_thresholds(tx2_pmu);
+		if (tx2_pmu->ring)
+			tx2_uncore_ring_write(tx2_pmu);
+		tx2_uncore_recorder_write(tx2_pmu);
+
+		tx2_pmu->hrtimer_interval = tx2_uncore_next_interval(tx2_pmu);
+		interval = min(interval, tx2_pmu->hrtimer_interval);
+
+		this_cpu_inc(tx2_pmu->stats->timer_fires);
+		this_cpu_add(tx2_pmu->stats->timer_ns, local_clock() - start);
+	}
+
+	/* A PMU joining meanwhile has already re-armed the timer */
+	if (!list_empty(&engine->pmus) && !hrtimer_is_queued(timer)) {
+		engine->interval = interval;
+		hrtimer_forward_now(timer, ns_to_ktime(interval));
+		hrtimer_set_expires_range_ns(timer,
+					     hrtimer_get_softexpires(timer),
+					     tx2_uncore_engine_slack(engine));
+		ret = HRTIMER_RESTART;
+	}
+	raw_spin_unlock(&engine->lock);
+
+	return ret;
+}
+
+static int tx2_uncore_engine_init(int node)
+{
+	struct tx2_smmu_engine *engine;
+
+	engine = kzalloc_node(sizeof(*engine), GFP_KERNEL, node);
+	if (!engine)
+		return -ENOMEM;
+
+	hrtimer_init(&engine->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	engine->hrtimer.function = tx2_hrtimer_callback;
+	init_irq_work(&engine->kick_work, tx2_uncore_engine_kick_work);
+	raw_spin_lock_init(&engine->lock);
+	INIT_LIST_HEAD(&engine->pmus);
+	engine->node = node;
+	engine->cpu = nr_cpu_ids;
+	engine->interval = TX2_PMU_HRTIMER_MIN_INTERVAL;
+	tx2_smmu_engines[node] = engine;
+	return 0;
+}
+
+static void tx2_uncore_engine_exit(int node)
+{
+	struct tx2_smmu_engine *engine = tx2_smmu_engines[node];
+
+	if (!engine)
+		return;
+
+	irq_work_sync(&engine->kick_work);
+	hrtimer_cancel(&engine->hrtimer);
+	kfree(engine);
+	tx2_smmu_engines[node] = NULL;
+}
+
+/*
+ * Move the engine off a CPU going offline, or off an isolated CPU once a
+ * housekeeping one is back, to a CPU of the node that services a PMU.
+ * The hrtimer core would otherwise migrate it to any CPU, isolated ones
+ * included.
+ */
+static void tx2_uncore_engine_move(struct tx2_smmu_engine *engine,
+		unsigned int cpu, unsigned int new_cpu)
+{
+	if (READ_ONCE(engine->cpu) != cpu || new_cpu >= nr_cpu_ids)
+		return;
+
+	hrtimer_cancel(&engine->hrtimer);
+	smp_call_function_single(new_cpu, tx2_uncore_engine_kick, engine, 1);
+}
+
+/*
+ * Counter references are taken by the events of the PMU and by the
+ * events of the aggregate PMUs it is a member of, which are serviced by
+ * other CPUs. The PMU lock keeps the reference counts in line with the
+ * control and filter registers they drive.
+ */
+static int tx2_uncore_counter_get(struct tx2_uncore_pmu *tx2_pmu,
+		int counter, u32 filter)
+{
+	unsigned long flags;
+	int idx = -EBUSY;
+
+	raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+	/* Program the ARID filter, unless another one is in use */
+	if (!tx2_uncore_get_filter(tx2_pmu, filter)) {
+		idx = alloc_counter(tx2_pmu, counter);
+		if (idx < 0)
+			tx2_uncore_put_filter(tx2_pmu);
+	}
+	raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+
+	return idx;
+}
+
+static void tx2_uncore_counter_put(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+	free_counter(tx2_pmu, counter);
+	tx2_uncore_put_filter(tx2_pmu);
+	raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+}
+
+/*
+ * The hardware counts from allocation on, events are started and stopped
+ * by their software baselines. Only the sweep follows the running users.
+ */
+static void tx2_uncore_counter_start(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	unsigned long flags;
+	bool first;
+
+	raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+	first = tx2_pmu->nr_running++ == 0;
+	raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+
+	/* Hand the PMU to the sampling engine of its node for first event */
+	if (first)
+		tx2_uncore_engine_join(tx2_pmu);
+}
+
+static void tx2_uncore_counter_stop(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+	tx2_pmu->nr_running--;
+	raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+}
+
+/*
+ * The counters cannot interrupt, so sampling is emulated: a timer on the
+ * CPU of the PMU polls the sampling events, and reports an overflow each
+ * time one of them has counted sample_period events since the last
+ * sample. For frequency based events perf adjusts sample_period from the
+ * counts as for a hardware PMU. Group members are read into the sample
+ * by perf, so a group gives the deltas of all its counters at once.
+ *
+ * The sampling events and the timer are only touched from the CPU of
+ * the PMU with interrupts disabled, or from the timer itself.
+ */
+static void tx2_uncore_event_stop(struct perf_event *event, int flags);
+
+/*
+ * Update a sampling event, true once it has counted its period and there
+ * are interrupted registers to report it with. Reads from other CPUs fold
+ * counts into event->count between ticks, so the period is accounted from
+ * a baseline of the folded total of the event instead, kept in last_tag
+ * (only x86 PMUs use that). Without registers the period stays pending.
+ */
+static bool tx2_uncore_sample_due(struct perf_event *event,
+		struct pt_regs *regs)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	u64 total;
+	s64 left;
+
+	tx2_uncore_event_update(event);
+	total = local64_read(&hwc->prev_count);
+
+	left = local64_read(&hwc->period_left) - (s64)(total - hwc->last_tag);
+	if (left > 0) {
+		local64_set(&hwc->period_left, left);
+		hwc->last_tag = total;
+		return false;
+	}
+	if (!regs)
+		return false;
+
+	/* Periods passed within one tick are reported as one sample */
+	hwc->last_period = hwc->sample_period;
+	local64_set(&hwc->period_left, hwc->sample_period);
+	hwc->last_tag = total;
+	return true;
+}
+
+static void tx2_uncore_sample_event(struct perf_event *event,
+		struct pt_regs *regs)
+{
+	struct perf_sample_data data;
+
+	perf_sample_data_init(&data, 0, event->hw.last_period);
+	if (perf_event_overflow(event, &data, regs))
+		tx2_uncore_event_stop(event, 0);
+}
+
+static enum hrtimer_restart tx2_uncore_sample_callback(struct hrtimer *timer)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	struct perf_event *event, *temp;
+	struct pt_regs *regs = get_irq_regs();
+	LIST_HEAD(due);
+
+	tx2_pmu = container_of(timer, struct tx2_uncore_pmu, sample_timer);
+
+	list_for_each_entry_safe(event, temp, &tx2_pmu->sample_events,
+				 active_entry) {
+		if (tx2_uncore_sample_due(event, regs))
+			list_move_tail(&event->active_entry, &due);
+	}
+
+	/*
+	 * An overflow may stop any event of the group, the one reported
+	 * included, and take it off whichever list it is on. So hold no
+	 * pointer across perf_event_overflow(): take the first due event,
+	 * put it back on the sampling list and report it.
+	 */
+	while (!list_empty(&due)) {
+		event = list_first_entry(&due, struct perf_event, active_entry);
+		list_move_tail(&event->active_entry, &tx2_pmu->sample_events);
+		tx2_uncore_sample_event(event, regs);
+	}
+
+	if (list_empty(&tx2_pmu->sample_events))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(TX2_PMU_SAMPLE_INTERVAL));
+	return HRTIMER_RESTART;
+}
+
+static void tx2_uncore_sample_start(struct tx2_uncore_pmu *tx2_pmu,
+		struct perf_event *event)
+{
+	struct hw_perf_event *hwc = &event->hw;
+
+	/* perf zeroes period_left when it changes sample_period */
+	if (local64_read(&hwc->period_left) <= 0)
+		local64_set(&hwc->period_left, hwc->sample_period);
+	hwc->last_tag = local64_read(&hwc->prev_count);
+
+	list_add_tail(&event->active_entry, &tx2_pmu->sample_events);
+	if (!hrtimer_is_queued(&tx2_pmu->sample_timer))
+		hrtimer_start(&tx2_pmu->sample_timer,
+			      ns_to_ktime(TX2_PMU_SAMPLE_INTERVAL),
+			      HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+static void tx2_uncore_sample_stop(struct tx2_uncore_pmu *tx2_pmu,
+		struct perf_event *event)
+{
+	list_del_init(&event->active_entry);
+
+	/* From within the callback this fails, the callback then stops */
+	if (list_empty(&tx2_pmu->sample_events))
+		hrtimer_try_to_cancel(&tx2_pmu->sample_timer);
+}
+
+static void tx2_uncore_event_start(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+	struct tx2_smmu_counter *cnt;
+
+	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+	cnt = &tx2_pmu->counters[GET_COUNTERID(event)];
+
+	/* take the baseline, then enable the counter for its first user */
+	tx2_uncore_counter_update(tx2_pmu, GET_COUNTERID(event));
+	local64_set(&hwc->prev_count, atomic64_read(&cnt->total));
+	tx2_uncore_counter_start(tx2_pmu, GET_COUNTERID(event));
+	hwc->state = 0;
+	trace_tx2_smmu_event_start(tx2_pmu->name, GET_EVENTID(event),
+				   hwc->idx, GET_FILTER(event),
+				   local64_read(&event->count));
+
+	if (is_sampling_event(event)) {
+		tx2_uncore_sample_start(tx2_pmu, event);
+		perf_event_update_userpage(event);
+		return;
+	}
+
+	/* Within a transaction the user page is updated on commit */
+	if (tx2_pmu->txn_flags & PERF_PMU_TXN_ADD)
+		list_add_tail(&event->active_entry, &tx2_pmu->txn_events);
+	else
+		perf_event_update_userpage(event);
+}
+
+static void tx2_uncore_event_stop(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	if (hwc->state & PERF_HES_UPTODATE)
+		return;
+
+	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+
+	if (!(hwc->state & PERF_HES_STOPPED)) {
+		if (is_sampling_event(event))
+			tx2_uncore_sample_stop(tx2_pmu, event);
+		tx2_uncore_counter_stop(tx2_pmu, GET_COUNTERID(event));
+		hwc->state |= PERF_HES_STOPPED;
+	}
+	if (flags & PERF_EF_UPDATE) {
+		tx2_uncore_event_update(event);
+		hwc->state |= PERF_HES_UPTODATE;
+	}
+	trace_tx2_smmu_event_stop(tx2_pmu->name, GET_EVENTID(event), hwc->idx,
+				  GET_FILTER(event), local64_read(&event->count));
+}
+
+static int tx2_uncore_event_add(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+
+	/* Get the counter of this event, unless another filter is in use */
+	hwc->idx = tx2_uncore_counter_get(tx2_pmu, GET_EVENTID(event),
+					  tx2_uncore_event_filter(event));
+	if (hwc->idx < 0)
+		return -EAGAIN;
+	this_cpu_inc(tx2_pmu->stats->event_add);
+
+	/* set counter control and data registers base address */
+	hwc->config_base = (unsigned long)tx2_pmu->base +
+		SMMU_PERF_CTL * 4;
+	hwc->event_base = counter_addr(tx2_pmu, hwc->idx);
+
+	hwc->state = PERF_HES_UPTODATE | PERF_HES_STOPPED;
+	trace_tx2_smmu_event_add(tx2_pmu->name, GET_EVENTID(event), hwc->idx,
+				 GET_FILTER(event), local64_read(&event->count));
+	if (flags & PERF_EF_START)
+		tx2_uncore_event_start(event, flags);
+
+	return 0;
+}
+
+static void tx2_uncore_event_del(struct perf_event *event, int flags)
+{
+	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+
+	tx2_uncore_event_stop(event, PERF_EF_UPDATE);
+	list_del_init(&event->active_entry);
+	trace_tx2_smmu_event_del(tx2_pmu->name, GET_EVENTID(event), hwc->idx,
+				 GET_FILTER(event), local64_read(&event->count));
+
+	/* drop the reference to the counter and the filter */
+	tx2_uncore_counter_put(tx2_pmu, GET_COUNTERID(event));
+	this_cpu_inc(tx2_pmu->stats->event_del);
+
+	perf_event_update_userpage(event);
+	hwc->idx = -1;
+}
+
+/*
+ * Each counter read is an uncached MMIO access over the uncore bus. If
+ * the user accepts counts up to read_staleness old, serve the read from
+ * the totals of the last sweep and refresh them with one sweep of all
+ * counters when they are older than that.
+ */
+static void tx2_uncore_counter_refresh(struct tx2_uncore_pmu *tx2_pmu,
+		int counter)
+{
+	u64 staleness = READ_ONCE(tx2_pmu->read_staleness);
+
+	if (!staleness)
+		tx2_uncore_counter_update(tx2_pmu, counter);
+	else if (ktime_get_ns() - smp_load_acquire(&tx2_pmu->sweep_time) >=
+		 staleness)
+		tx2_uncore_sweep(tx2_pmu);
+}
+
+static void tx2_uncore_event_read(struct perf_event *event)
+{
+	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(event->pmu);
+
+	/* a group read folds the sweep taken when its transaction started */
+	if (!(tx2_pmu->txn_flags & PERF_PMU_TXN_READ))
+		tx2_uncore_counter_refresh(tx2_pmu, GET_COUNTERID(event));
+	tx2_uncore_event_fold(event);
+}
+
+/*
+ * A group read (PERF_FORMAT_GROUP) reads all members inside a
+ * PERF_PMU_TXN_READ transaction. Sweep all active counters back to back
+ * when it starts, and let the members fold that one snapshot. The
+ * counters keep running: stopping them would lose counts for every
+ * other user of the SMMU (always_on, thresholds, other sessions).
+ *
+ * A group is scheduled inside a PERF_PMU_TXN_ADD transaction. The group
+ * was validated at init and the counters are fixed function, so adding
+ * a member only takes references; the user pages of the members are
+ * updated once the group is known to fit.
+ */
+static void tx2_uncore_start_txn(struct pmu *pmu, unsigned int txn_flags)
+{
+	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(pmu);
+
+	WARN_ON_ONCE(tx2_pmu->txn_flags);
+	tx2_pmu->txn_flags = txn_flags;
+
+	if (txn_flags == PERF_PMU_TXN_READ)
+		tx2_uncore_sweep(tx2_pmu);
+}
+
+static void tx2_uncore_end_txn(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct perf_event *event, *tmp;
+
+	list_for_each_entry_safe(event, tmp, &tx2_pmu->txn_events,
+				 active_entry)
+		list_del_init(&event->active_entry);
+
+	tx2_pmu->txn_flags = 0;
+}
+
+static int tx2_uncore_commit_txn(struct pmu *pmu)
+{
+	struct tx2_uncore_pmu *tx2_pmu = pmu_to_tx2_pmu(pmu);
+	struct perf_event *event;
+
+	list_for_each_entry(event, &tx2_pmu->txn_events, active_entry)
+		perf_event_update_userpage(event);
+
+	tx2_uncore_end_txn(tx2_pmu);
+	return 0;
+}
+
+static void tx2_uncore_cancel_txn(struct pmu *pmu)
+{
+	tx2_uncore_end_txn(pmu_to_tx2_pmu(pmu));
+}
+
+/*
+ * always_on holds a reference on every counter of an SMMU PMU, without
+ * one on the filter: perf sessions keep working alongside, and the
+ * totals follow the filter of any session that programs one.
+ */
+static void tx2_uncore_totals_start(struct tx2_uncore_pmu *tx2_pmu)
+{
+	unsigned long flags;
+	int idx;
+
+	raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++)
+		alloc_counter(tx2_pmu, idx);
+	raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++)
+		tx2_uncore_counter_start(tx2_pmu, idx);
+}
+
+static void tx2_uncore_totals_stop(struct tx2_uncore_pmu *tx2_pmu)
+{
+	unsigned long flags;
+	int idx;
+
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++)
+		tx2_uncore_counter_stop(tx2_pmu, idx);
+
+	raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++)
+		free_counter(tx2_pmu, idx);
+	raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+}
+
+/* Like always_on, a threshold holds its counter but not the filter */
+static int tx2_uncore_threshold_set(struct tx2_uncore_pmu *tx2_pmu, int idx,
+		u64 threshold)
+{
+	unsigned long flags;
+	u64 old;
+
+	mutex_lock(&tx2_pmu->threshold_lock);
+	if (tx2_pmu->thresholds_closed) {
+		mutex_unlock(&tx2_pmu->threshold_lock);
+		return -ENODEV;
+	}
+
+	old = tx2_pmu->thresholds[idx];
+	WRITE_ONCE(tx2_pmu->thresholds[idx], threshold);
+	if (!old && threshold) {
+		raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+		alloc_counter(tx2_pmu, idx);
+		raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+		tx2_uncore_counter_start(tx2_pmu, idx);
+		WRITE_ONCE(tx2_pmu->nr_thresholds, tx2_pmu->nr_thresholds + 1);
+	} else if (old && !threshold) {
+		tx2_uncore_counter_stop(tx2_pmu, idx);
+		raw_spin_lock_irqsave(&tx2_pmu->lock, flags);
+		free_counter(tx2_pmu, idx);
+		raw_spin_unlock_irqrestore(&tx2_pmu->lock, flags);
+		WRITE_ONCE(tx2_pmu->nr_thresholds, tx2_pmu->nr_thresholds - 1);
+
+		/*
+		 * The engine may drop the PMU before it checks again, so
+		 * the alert of the event goes away here.
+		 */
+		raw_spin_lock_irqsave(&tx2_pmu->engine->lock, flags);
+		if (tx2_pmu->alerts & BIT(idx)) {
+			WRITE_ONCE(tx2_pmu->alerts, tx2_pmu->alerts & ~BIT(idx));
+			schedule_work(&tx2_pmu->alert_work);
+		}
+		raw_spin_unlock_irqrestore(&tx2_pmu->engine->lock, flags);
+	}
+	mutex_unlock(&tx2_pmu->threshold_lock);
+	return 0;
+}
+
+/* Drop all thresholds for good, on unload */
+static void tx2_uncore_thresholds_close(struct tx2_uncore_pmu *tx2_pmu)
+{
+	int idx;
+
+	for (idx = 0; idx < tx2_pmu->max_counters; idx++)
+		tx2_uncore_threshold_set(tx2_pmu, idx, 0);
+
+	mutex_lock(&tx2_pmu->threshold_lock);
+	tx2_pmu->thresholds_closed = true;
+	mutex_unlock(&tx2_pmu->threshold_lock);
+}
+
+static void tx2_uncore_alert_work(struct work_struct *work)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	char env[32 + SMMU_PERF_EVENT_MAX * 24];
+	char *envp[] = { env, NULL };
+	const char *sep = "";
+	unsigned long alerts;
+	int len, idx;
+
+	tx2_pmu = container_of(work, struct tx2_uncore_pmu, alert_work);
+	alerts = READ_ONCE(tx2_pmu->alerts);
+
+	len = scnprintf(env, sizeof(env), "SMMU_ALERT=");
+	for_each_set_bit(idx, &alerts, SMMU_PERF_EVENT_MAX) {
+		len += scnprintf(env + len, sizeof(env) - len, "%s%s", sep,
+				 smmu_event_name[idx]);
+		sep = ",";
+	}
+
+	sysfs_notify(&tx2_pmu->pmu.dev->kobj, "thresholds", "alert");
+	kobject_uevent_env(&tx2_pmu->pmu.dev->kobj, KOBJ_CHANGE, envp);
+}
+
+/* The history is held with all counters, as always_on does */
+static int tx2_uncore_recorder_arm(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_ring_record *records = NULL;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&tx2_pmu->recorder_lock);
+	if (tx2_pmu->recorder_closed) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (tx2_pmu->recorder_state == TX2_RECORDER_OFF) {
+		records = vzalloc(TX2_PMU_RECORDER_RECORDS * sizeof(*records));
+		if (!records) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	raw_spin_lock_irqsave(&tx2_pmu->engine->lock, flags);
+	if (records)
+		tx2_pmu->recorder = records;
+	tx2_pmu->recorder_head = 0;
+	tx2_pmu->recorder_next = 0;
+	tx2_pmu->recorder_trigger_time = 0;
+	WRITE_ONCE(tx2_pmu->recorder_state, TX2_RECORDER_ARMED);
+	raw_spin_unlock_irqrestore(&tx2_pmu->engine->lock, flags);
+
+	if (records)
+		tx2_uncore_totals_start(tx2_pmu);
+	sysfs_notify(&tx2_pmu->pmu.dev->kobj, "recorder", "state");
+out:
+	mutex_unlock(&tx2_pmu->recorder_lock);
+	return ret;
+}
+
+static void tx2_uncore_recorder_off(struct tx2_uncore_pmu *tx2_pmu)
+{
+	struct tx2_smmu_ring_record *records;
+	unsigned long flags;
+
+	mutex_lock(&tx2_pmu->recorder_lock);
+	if (tx2_pmu->recorder_state == TX2_RECORDER_OFF)
+		goto out;
+
+	raw_spin_lock_irqsave(&tx2_pmu->engine->lock, flags);
+	records = tx2_pmu->recorder;
+	tx2_pmu->recorder = NULL;
+	WRITE_ONCE(tx2_pmu->recorder_state, TX2_RECORDER_OFF);
+	raw_spin_unlock_irqrestore(&tx2_pmu->engine->lock, flags);
+
+	tx2_uncore_totals_stop(tx2_pmu);
+	vfree(records);
+	sysfs_notify(&tx2_pmu->pmu.dev->kobj, "recorder", "state");
+out:
+	mutex_unlock(&tx2_pmu->recorder_lock);
+}
+
+static void tx2_uncore_recorder_close(struct tx2_uncore_pmu *tx2_pmu)
+{
+	tx2_uncore_recorder_off(tx2_pmu);
+
+	mutex_lock(&tx2_pmu->recorder_lock);
+	tx2_pmu->recorder_closed = true;
+	mutex_unlock(&tx2_pmu->recorder_lock);
+}
+
+static void tx2_uncore_recorder_work(struct work_struct *work)
 {
 	struct tx2_uncore_pmu *tx2_pmu;
-	int max_counters, idx;
-	struct perf_event *event = NULL;
 
-	tx2_pmu = container_of(timer, struct tx2_uncore_pmu, hrtimer);
-	max_counters = tx2_pmu->max_counters;
+	tx2_pmu = container_of(work, struct tx2_uncore_pmu, recorder_work);
+	sysfs_notify(&tx2_pmu->pmu.dev->kobj, "recorder", "state");
+}
 
-	if (bitmap_empty(tx2_pmu->active_counters, max_counters))
-		return HRTIMER_NORESTART;
+/*
+ * Aggregate PMUs, uncore_smmu_socket<N> and uncore_smmu_all, count an
+ * event on all SMMUs of a socket or of the system. Each aggregate event
+ * holds a reference on the counter of every member PMU and reports the
+ * sum of their totals, so one read serves the whole socket.
+ *
+ * The member list is only changed at module load and unload, when no
+ * aggregate PMU is registered.
+ */
+static bool tx2_uncore_agg_member(struct tx2_uncore_pmu *agg,
+		struct tx2_uncore_pmu *tx2_pmu)
+{
+	return tx2_pmu->smmu &&
+		(agg->node == NUMA_NO_NODE || agg->node == tx2_pmu->node);
+}
 
-	for_each_set_bit(idx, tx2_pmu->active_counters, max_counters) {
-		event = tx2_pmu->events[idx];
-		tx2_uncore_event_update(event);
+static u64 tx2_uncore_agg_total(struct tx2_uncore_pmu *agg, int counter,
+		bool exact)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	u64 total = 0;
+
+	list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+		if (!tx2_uncore_agg_member(agg, tx2_pmu))
+			continue;
+		if (exact)
+			tx2_uncore_counter_update(tx2_pmu, counter);
+		else
+			tx2_uncore_counter_refresh(tx2_pmu, counter);
+		total += atomic64_read(&tx2_pmu->counters[counter].total);
 	}
+	return total;
+}
 
-	for_each_set_bit(idx, tx2_pmu->active_counters, max_counters) {
-		event = tx2_pmu->events[idx];
-		/* Start counter again */
-		reg_writel(0xfffffc07, event->hw.config_base);
-		break;
+static void tx2_uncore_agg_event_start(struct perf_event *event, int flags)
+{
+	struct tx2_uncore_pmu *agg = pmu_to_tx2_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	local64_set(&hwc->prev_count,
+		    tx2_uncore_agg_total(agg, GET_COUNTERID(event), true));
+
+	list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+		if (tx2_uncore_agg_member(agg, tx2_pmu))
+			tx2_uncore_counter_start(tx2_pmu, GET_COUNTERID(event));
 	}
+	hwc->state = 0;
+	perf_event_update_userpage(event);
+}
 
-	hrtimer_forward_now(timer, ns_to_ktime(tx2_pmu->hrtimer_interval));
-	return HRTIMER_RESTART;
+static void tx2_uncore_agg_event_stop(struct perf_event *event, int flags)
+{
+	struct tx2_uncore_pmu *agg = pmu_to_tx2_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	if (hwc->state & PERF_HES_UPTODATE)
+		return;
+
+	if (!(hwc->state & PERF_HES_STOPPED)) {
+		list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+			if (tx2_uncore_agg_member(agg, tx2_pmu))
+				tx2_uncore_counter_stop(tx2_pmu,
+							GET_COUNTERID(event));
+		}
+		hwc->state |= PERF_HES_STOPPED;
+	}
+	if (flags & PERF_EF_UPDATE) {
+		tx2_uncore_event_fold_total(event,
+			tx2_uncore_agg_total(agg, GET_COUNTERID(event), true));
+		hwc->state |= PERF_HES_UPTODATE;
+	}
+}
+
+/*
+ * Aggregates count unfiltered, so they cannot be scheduled while an
+ * SMMU of theirs is filtering; perf multiplexes them with the filter.
+ */
+static int tx2_uncore_agg_event_add(struct perf_event *event, int flags)
+{
+	struct tx2_uncore_pmu *agg = pmu_to_tx2_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+		if (!tx2_uncore_agg_member(agg, tx2_pmu))
+			continue;
+		if (tx2_uncore_counter_get(tx2_pmu, GET_EVENTID(event), 0) < 0)
+			goto fail;
+	}
+
+	hwc->idx = GET_EVENTID(event);
+	hwc->state = PERF_HES_UPTODATE | PERF_HES_STOPPED;
+	if (flags & PERF_EF_START)
+		tx2_uncore_agg_event_start(event, flags);
+
+	return 0;
+
+fail:
+	list_for_each_entry_continue_reverse(tx2_pmu, &tx2_pmus, entry) {
+		if (tx2_uncore_agg_member(agg, tx2_pmu))
+			tx2_uncore_counter_put(tx2_pmu, GET_EVENTID(event));
+	}
+	return -EAGAIN;
+}
+
+static void tx2_uncore_agg_event_del(struct perf_event *event, int flags)
+{
+	struct tx2_uncore_pmu *agg = pmu_to_tx2_pmu(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_uncore_agg_event_stop(event, PERF_EF_UPDATE);
+
+	list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+		if (tx2_uncore_agg_member(agg, tx2_pmu))
+			tx2_uncore_counter_put(tx2_pmu, GET_COUNTERID(event));
+	}
+
+	perf_event_update_userpage(event);
+	hwc->idx = -1;
+}
+
+static void tx2_uncore_agg_event_read(struct perf_event *event)
+{
+	struct tx2_uncore_pmu *agg = pmu_to_tx2_pmu(event->pmu);
+
+	tx2_uncore_event_fold_total(event,
+		tx2_uncore_agg_total(agg, GET_COUNTERID(event), false));
 }
 
 static int tx2_uncore_pmu_register(
@@ -647,6 +2772,32 @@ static int tx2_uncore_pmu_register(
 		.start		= tx2_uncore_event_start,
 		.stop		= tx2_uncore_event_stop,
 		.read		= tx2_uncore_event_read,
+		.start_txn	= tx2_uncore_start_txn,
+		.commit_txn	= tx2_uncore_commit_txn,
+		.cancel_txn	= tx2_uncore_cancel_txn,
+	};
+
+	tx2_pmu->pmu.name = kasprintf(GFP_KERNEL, "%s", name);
+
+	return perf_pmu_register(&tx2_pmu->pmu, tx2_pmu->pmu.name, -1);
+}
+
+static int tx2_uncore_agg_pmu_register(
+		struct tx2_uncore_pmu *tx2_pmu)
+{
+	char *name = tx2_pmu->name;
+
+	/* Perf event registration */
+	tx2_pmu->pmu = (struct pmu) {
+		.module         = THIS_MODULE,
+		.attr_groups	= tx2_pmu->attr_groups,
+		.task_ctx_nr	= perf_invalid_context,
+		.event_init	= tx2_uncore_event_init,
+		.add		= tx2_uncore_agg_event_add,
+		.del		= tx2_uncore_agg_event_del,
+		.start		= tx2_uncore_agg_event_start,
+		.stop		= tx2_uncore_agg_event_stop,
+		.read		= tx2_uncore_agg_event_read,
 	};
 
 	tx2_pmu->pmu.name = kasprintf(GFP_KERNEL, "%s", name);
@@ -654,57 +2805,245 @@ static int tx2_uncore_pmu_register(
 	return perf_pmu_register(&tx2_pmu->pmu, tx2_pmu->pmu.name, -1);
 }
 
+/*
+ * Snapshot ring character device, one per SMMU PMU. The ring is set up
+ * on open and torn down on the last close, once it is unmapped as well;
+ * a single reader at a time keeps it single consumer. Records are added
+ * from the next engine pass on while counters of the PMU are active.
+ */
+static size_t tx2_uncore_ring_size(void)
+{
+	return PAGE_SIZE * (1 + (size_t)ring_pages);
+}
+
+static int tx2_uncore_ring_open(struct inode *inode, struct file *file)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	struct tx2_smmu_ring_header *hdr;
+	unsigned long flags;
+
+	tx2_pmu = container_of(file->private_data, struct tx2_uncore_pmu,
+			       ring_dev);
+
+	if (test_and_set_bit_lock(0, &tx2_pmu->ring_busy))
+		return -EBUSY;
+
+	hdr = vmalloc_user(tx2_uncore_ring_size());
+	if (!hdr) {
+		clear_bit_unlock(0, &tx2_pmu->ring_busy);
+		return -ENOMEM;
+	}
+
+	hdr->version = TX2_SMMU_RING_VERSION;
+	hdr->record_size = sizeof(struct tx2_smmu_ring_record);
+	hdr->nr_records = (size_t)ring_pages * PAGE_SIZE /
+			  sizeof(struct tx2_smmu_ring_record);
+	hdr->nr_counters = tx2_pmu->max_counters;
+
+	raw_spin_lock_irqsave(&tx2_pmu->engine->lock, flags);
+	tx2_pmu->ring_records = (void *)hdr + PAGE_SIZE;
+	tx2_pmu->ring_nr = hdr->nr_records;
+	tx2_pmu->ring_head = 0;
+	tx2_pmu->ring = hdr;
+	raw_spin_unlock_irqrestore(&tx2_pmu->engine->lock, flags);
+
+	file->private_data = tx2_pmu;
+	return 0;
+}
+
+static int tx2_uncore_ring_release(struct inode *inode, struct file *file)
+{
+	struct tx2_uncore_pmu *tx2_pmu = file->private_data;
+	struct tx2_smmu_ring_header *hdr;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&tx2_pmu->engine->lock, flags);
+	hdr = tx2_pmu->ring;
+	tx2_pmu->ring = NULL;
+	raw_spin_unlock_irqrestore(&tx2_pmu->engine->lock, flags);
+
+	vfree(hdr);
+	clear_bit_unlock(0, &tx2_pmu->ring_busy);
+	return 0;
+}
+
+static int tx2_uncore_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tx2_uncore_pmu *tx2_pmu = file->private_data;
+
+	return remap_vmalloc_range(vma, tx2_pmu->ring, vma->vm_pgoff);
+}
+
+static const struct file_operations tx2_uncore_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tx2_uncore_ring_open,
+	.release	= tx2_uncore_ring_release,
+	.mmap		= tx2_uncore_ring_mmap,
+	.llseek		= noop_llseek,
+};
+
 static int tx2_uncore_pmu_add_dev(struct tx2_uncore_pmu *tx2_pmu)
 {
-	int ret, cpu;
+	int ret;
 
-	cpu = cpumask_any_and(cpumask_of_node(tx2_pmu->node),
-			cpu_online_mask);
-	tx2_pmu->cpu = cpu;
-	hrtimer_init(&tx2_pmu->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	tx2_pmu->hrtimer.function = tx2_hrtimer_callback;
+	/* no events until the PMU has a CPU, see below */
+	tx2_pmu->cpu = nr_cpu_ids;
 
-	ret = tx2_uncore_pmu_register(tx2_pmu);
+	if (tx2_pmu->smmu) {
+		tx2_pmu->engine = tx2_smmu_engines[tx2_pmu->node];
+		ret = tx2_uncore_pmu_register(tx2_pmu);
+	} else {
+		ret = tx2_uncore_agg_pmu_register(tx2_pmu);
+	}
 	if (ret) {
 		pr_err("%s PMU: Failed to init driver\n", tx2_pmu->name);
 		return -ENODEV;
 	}
 
+	/*
+	 * Pick the CPU and publish the PMU in one go, so concurrent picks
+	 * count its load, and register the hotplug callback before the CPU
+	 * can go offline.
+	 */
+	cpus_read_lock();
+	mutex_lock(&tx2_pmus_lock);
+	tx2_pmu->cpu = tx2_uncore_pick_cpu(tx2_pmu, nr_cpu_ids);
+	list_add(&tx2_pmu->entry, &tx2_pmus);
+	mutex_unlock(&tx2_pmus_lock);
+
+	ret = cpuhp_state_add_instance_nocalls_cpuslocked(tx2_smmu_hp_state,
+							  &tx2_pmu->hpnode);
+	if (ret) {
+		mutex_lock(&tx2_pmus_lock);
+		list_del(&tx2_pmu->entry);
+		mutex_unlock(&tx2_pmus_lock);
+	}
+	cpus_read_unlock();
 	if (ret) {
 		pr_err("Error %d registering hotplug", ret);
+		perf_pmu_unregister(&tx2_pmu->pmu);
 		return ret;
 	}
 
-	/* Add to list */
-	list_add(&tx2_pmu->entry, &tx2_pmus);
+	/* Point tooling at the SMMU and at the PCI devices behind it */
+	if (tx2_pmu->smmu) {
+		if (sysfs_create_link(&tx2_pmu->pmu.dev->kobj,
+				      &tx2_pmu->smmu->kobj, "smmu"))
+			pr_warn("%s PMU: Failed to link smmu device\n",
+				tx2_pmu->name);
+		tx2_pmu->endpoints = kobject_create_and_add("endpoints",
+						&tx2_pmu->pmu.dev->kobj);
+
+		if (ring_pages) {
+			tx2_pmu->ring_dev.minor = MISC_DYNAMIC_MINOR;
+			tx2_pmu->ring_dev.name = tx2_pmu->name;
+			tx2_pmu->ring_dev.fops = &tx2_uncore_ring_fops;
+			tx2_pmu->ring_dev.mode = 0600;
+			if (misc_register(&tx2_pmu->ring_dev)) {
+				pr_warn("%s PMU: Failed to add ring device\n",
+					tx2_pmu->name);
+				tx2_pmu->ring_dev.fops = NULL;
+			}
+		}
+	}
+
+	if (always_on && tx2_pmu->smmu)
+		tx2_uncore_totals_start(tx2_pmu);
 
 	printk("%s SMMU PMU registered\n", tx2_pmu->pmu.name);
 	return ret;
 }
 
-static struct tx2_uncore_pmu *tx2_uncore_pmu_init_dev(int node , int smmu)
+/*
+ * Firmware does not always describe the proximity of an SMMU, fall back
+ * to the address slice of its socket then.
+ */
+static int tx2_uncore_smmu_node(struct device *dev, phys_addr_t base)
+{
+	int node = dev_to_node(dev);
+
+	if (node == NUMA_NO_NODE && base >= SMMU_BASE_ADDR)
+		node = (base - SMMU_BASE_ADDR) / SMMU_NODE_STRIDE;
+	if (node < 0 || node >= MAX_NUMNODES || !node_online(node))
+		node = first_online_node;
+
+	return node;
+}
+
+static struct tx2_uncore_pmu *tx2_uncore_pmu_init_dev(
+		struct platform_device *pdev)
 {
 	struct tx2_uncore_pmu *tx2_pmu;
+	struct resource *res;
 	void __iomem *base;
 
+	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	if (!res)
+		return NULL;
+
 	tx2_pmu = kzalloc(sizeof(*tx2_pmu), GFP_KERNEL);
 	if (!tx2_pmu)
 		return NULL;
 
-	base = ioremap(SMMU_BASE(node, smmu), 0xffff);
+	tx2_pmu->stats = alloc_percpu(struct tx2_smmu_stats);
+	if (!tx2_pmu->stats) {
+		kfree(tx2_pmu);
+		return NULL;
+	}
+
+	base = ioremap(res->start, 0xffff);
+	if (!base) {
+		free_percpu(tx2_pmu->stats);
+		kfree(tx2_pmu);
+		return NULL;
+	}
 
 	INIT_LIST_HEAD(&tx2_pmu->entry);
+	INIT_LIST_HEAD(&tx2_pmu->txn_events);
+	INIT_LIST_HEAD(&tx2_pmu->engine_entry);
+	INIT_LIST_HEAD(&tx2_pmu->sample_events);
+	mutex_init(&tx2_pmu->threshold_lock);
+	INIT_WORK(&tx2_pmu->alert_work, tx2_uncore_alert_work);
+	mutex_init(&tx2_pmu->recorder_lock);
+	INIT_WORK(&tx2_pmu->recorder_work, tx2_uncore_recorder_work);
+	hrtimer_init(&tx2_pmu->sample_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_HARD);
+	tx2_pmu->sample_timer.function = tx2_uncore_sample_callback;
+	raw_spin_lock_init(&tx2_pmu->lock);
 	tx2_pmu->base = base;
-	tx2_pmu->node = node;
-	tx2_pmu->max_counters = TX2_PMU_SMMU_MAX_COUNTERS;
+	/* drop a filter left behind by firmware or a previous load */
+	reg_writel(tx2_pmu, 0, (unsigned long)base + SMMU_PERF_FILTER_ARID * 4);
+	tx2_pmu->phys_base = res->start;
+	tx2_pmu->smmu = get_device(&pdev->dev);
+	tx2_pmu->node = tx2_uncore_smmu_node(&pdev->dev, res->start);
+	tx2_pmu->max_counters = SMMU_PERF_EVENT_MAX;
 	tx2_pmu->max_events = SMMU_PERF_EVENT_MAX;
-	tx2_pmu->hrtimer_interval = TX2_PMU_HRTIMER_INTERVAL;
+	tx2_pmu->mmio64 = mmio64;
+	tx2_pmu->hrtimer_min_interval = TX2_PMU_HRTIMER_MIN_INTERVAL;
+	tx2_pmu->hrtimer_max_interval = TX2_PMU_HRTIMER_MAX_INTERVAL;
+	tx2_pmu->hrtimer_interval = TX2_PMU_HRTIMER_MIN_INTERVAL;
+	tx2_pmu->ring_interval = TX2_PMU_RING_INTERVAL;
+	tx2_pmu->recorder_interval = TX2_PMU_RECORDER_INTERVAL;
+	tx2_pmu->recorder_fast_interval = TX2_PMU_RECORDER_FAST_INTERVAL;
+	tx2_pmu->recorder_post = TX2_PMU_RECORDER_POST;
 	tx2_pmu->attr_groups = smmu_pmu_attr_groups;
-	tx2_pmu->name = kasprintf( GFP_KERNEL, "uncore_smmu_%d", (node * 3) + smmu);
+	/* named after the SMMU, as its iommu device smmu3.0x<base> is */
+	tx2_pmu->name = kasprintf(GFP_KERNEL, "uncore_smmu_%llx",
+				  (u64)res->start);
 
 	return tx2_pmu;
 }
 
+static void tx2_uncore_pmu_free(struct tx2_uncore_pmu *tx2_pmu)
+{
+	put_device(tx2_pmu->smmu);
+	if (tx2_pmu->base)
+		iounmap(tx2_pmu->base);
+	free_percpu(tx2_pmu->stats);
+	kfree(tx2_pmu->pmu.name);
+	kfree(tx2_pmu->name);
+	kfree(tx2_pmu);
+}
 
 u32 asmmu_regval, asmmu_regno;
 struct debugfs_regset32 *asmmu_get_regset(void __iomem *base)
@@ -742,52 +3081,299 @@ static int asmmu_regwrite_get(void *data, u64 *val)
 	return 0;
 }
 
-struct dentry *asmmu_debugfs_dir[8];
 DEFINE_SIMPLE_ATTRIBUTE(asmmu_regwrite_fops, asmmu_regwrite_get,
 			asmmu_regwrite_set, "%llu\n");
 
-static int tx2_uncore_pmu_add(int node, int smmu)
+static int tx2_uncore_stats_show(struct seq_file *s, void *unused)
+{
+	struct tx2_uncore_pmu *tx2_pmu = s->private;
+	struct tx2_smmu_stats sum = {}, *stats;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(tx2_pmu->stats, cpu);
+		sum.timer_fires += stats->timer_fires;
+		sum.timer_ns += stats->timer_ns;
+		sum.mmio_reads += stats->mmio_reads;
+		sum.mmio_writes += stats->mmio_writes;
+		sum.event_add += stats->event_add;
+		sum.event_del += stats->event_del;
+		for (i = 0; i < TX2_SMMU_STATS_LAT_BUCKETS; i++)
+			sum.read_lat[i] += stats->read_lat[i];
+	}
+
+	seq_printf(s, "timer_fires: %llu\n", sum.timer_fires);
+	seq_printf(s, "timer_ns: %llu\n", sum.timer_ns);
+	seq_printf(s, "mmio_reads: %llu\n", sum.mmio_reads);
+	seq_printf(s, "mmio_writes: %llu\n", sum.mmio_writes);
+	seq_printf(s, "event_add: %llu\n", sum.event_add);
+	seq_printf(s, "event_del: %llu\n", sum.event_del);
+
+	seq_puts(s, "mmio_read_ns:\n");
+	for (i = 0; i < TX2_SMMU_STATS_LAT_BUCKETS - 1; i++)
+		seq_printf(s, "  %8lu - %8lu: %llu\n", i ? BIT(i) : 0,
+			   BIT(i + 1) - 1, sum.read_lat[i]);
+	seq_printf(s, "  %8lu -         : %llu\n", BIT(i), sum.read_lat[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tx2_uncore_stats);
+
+static int tx2_uncore_pmu_add(struct platform_device *pdev)
 {
 	struct tx2_uncore_pmu *tx2_pmu;
-	int smmu_id = node * 3 + smmu;
 
-	tx2_pmu = tx2_uncore_pmu_init_dev(node, smmu);
+	tx2_pmu = tx2_uncore_pmu_init_dev(pdev);
 
 	if (!tx2_pmu)
 		return -1;
 
-	if (tx2_uncore_pmu_add_dev(tx2_pmu)) {
+	if (!tx2_smmu_engines[tx2_pmu->node] ||
+	    tx2_uncore_pmu_add_dev(tx2_pmu)) {
+		tx2_uncore_pmu_free(tx2_pmu);
 		return -1;
 	}
 
+	tx2_pmu->debugfs = debugfs_create_dir(tx2_pmu->name, NULL);
+	if (IS_ERR(tx2_pmu->debugfs))
+		return 0;
 
-	asmmu_debugfs_dir[smmu_id] = debugfs_create_dir(tx2_pmu->name, NULL);
-	if (asmmu_debugfs_dir == NULL)
-		return -ENOMEM;
-
-	debugfs_create_regset32("regdump", S_IRUGO, asmmu_debugfs_dir[smmu_id],
+	debugfs_create_regset32("regdump", S_IRUGO, tx2_pmu->debugfs,
 				asmmu_get_regset(tx2_pmu->base));
 
-	debugfs_create_x32("regno", 0644, asmmu_debugfs_dir[smmu_id],
+	debugfs_create_x32("regno", 0644, tx2_pmu->debugfs,
 			   &asmmu_regno);
-	debugfs_create_x32("value", 0644, asmmu_debugfs_dir[smmu_id],
+	debugfs_create_x32("value", 0644, tx2_pmu->debugfs,
 			   &asmmu_regval);
 
-	debugfs_create_file("write_cmd", 0644, asmmu_debugfs_dir[smmu_id],
+	debugfs_create_file("write_cmd", 0644, tx2_pmu->debugfs,
 			    tx2_pmu->base, &asmmu_regwrite_fops);
 
+	debugfs_create_file("stats", 0444, tx2_pmu->debugfs,
+			    tx2_pmu, &tx2_uncore_stats_fops);
+
+	return 0;
+}
+
+/*
+ * The PMU registers are implementation defined, so an SMMUv3 of anything
+ * but ThunderX2 must be left alone. IORT names the model of each SMMU,
+ * in the node kept as platform data; DT does not, so there the system
+ * has to be a ThunderX2.
+ */
+static bool tx2_uncore_is_tx2_smmu(struct device *dev)
+{
+	u32 midr = read_cpuid_id() & MIDR_CPU_MODEL_MASK;
+#ifdef CONFIG_ACPI
+	struct acpi_iort_smmu_v3 *iort_smmu;
+	struct acpi_iort_node *node;
+
+	if (!dev->of_node && dev_get_platdata(dev)) {
+		node = *(struct acpi_iort_node **)dev_get_platdata(dev);
+		iort_smmu = (struct acpi_iort_smmu_v3 *)node->node_data;
+		return iort_smmu->model == ACPI_IORT_SMMU_V3_CAVIUM_CN99XX;
+	}
+#endif
+
+	return midr == MIDR_CAVIUM_THUNDERX2 || midr == MIDR_BRCM_VULCAN;
+}
+
+/*
+ * Only SMMUs described by firmware get a PMU, as arm-smmu-v3 platform
+ * devices from IORT or as "arm,smmu-v3" nodes from DT, and only those of
+ * a ThunderX2.
+ */
+static int tx2_uncore_smmu_probe(struct device *dev, void *data)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+
+	if (strcmp(pdev->name, "arm-smmu-v3") &&
+	    !of_device_is_compatible(dev->of_node, "arm,smmu-v3"))
+		return 0;
+
+	if (!tx2_uncore_is_tx2_smmu(dev)) {
+		dev_dbg(dev, "not a ThunderX2 SMMU, no PMU\n");
+		return 0;
+	}
+
+	tx2_uncore_pmu_add(pdev);
+	return 0;
+}
+
+/* Add the aggregate PMU of a node, or of all SMMUs for NUMA_NO_NODE */
+static int tx2_uncore_agg_add(int node)
+{
+	struct tx2_uncore_pmu *tx2_pmu, *member;
+	bool found = false;
+
+	list_for_each_entry(member, &tx2_pmus, entry) {
+		if (member->smmu &&
+		    (node == NUMA_NO_NODE || member->node == node))
+			found = true;
+	}
+	if (!found)
+		return 0;
+
+	tx2_pmu = kzalloc(sizeof(*tx2_pmu), GFP_KERNEL);
+	if (!tx2_pmu)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&tx2_pmu->entry);
+	INIT_LIST_HEAD(&tx2_pmu->txn_events);
+	INIT_LIST_HEAD(&tx2_pmu->engine_entry);
+	raw_spin_lock_init(&tx2_pmu->lock);
+	tx2_pmu->node = node;
+	tx2_pmu->max_counters = SMMU_PERF_EVENT_MAX;
+	tx2_pmu->max_events = SMMU_PERF_EVENT_MAX;
+	tx2_pmu->attr_groups = smmu_agg_attr_groups;
+	if (node == NUMA_NO_NODE)
+		tx2_pmu->name = kasprintf(GFP_KERNEL, "uncore_smmu_all");
+	else
+		tx2_pmu->name = kasprintf(GFP_KERNEL, "uncore_smmu_socket%d",
+					  node);
+
+	if (tx2_uncore_pmu_add_dev(tx2_pmu)) {
+		tx2_uncore_pmu_free(tx2_pmu);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+/*
+ * Keep the endpoints directory of each PMU in line with the PCI devices
+ * translated by its SMMU. The IOMMU mapping of a device may only be set
+ * up once a driver binds to it, so check again then.
+ */
+static void tx2_uncore_link_endpoint(struct device *dev, bool link)
+{
+	struct iommu_fwspec *fwspec = dev_iommu_fwspec_get(dev);
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	mutex_lock(&tx2_pmus_lock);
+	list_for_each_entry(tx2_pmu, &tx2_pmus, entry) {
+		if (!tx2_pmu->endpoints)
+			continue;
+		if (!link)
+			sysfs_remove_link(tx2_pmu->endpoints, dev_name(dev));
+		else if (fwspec && fwspec->iommu_fwnode == tx2_pmu->smmu->fwnode)
+			sysfs_create_link_nowarn(tx2_pmu->endpoints,
+						 &dev->kobj, dev_name(dev));
+	}
+	mutex_unlock(&tx2_pmus_lock);
+}
+
+static int tx2_uncore_pci_notify(struct notifier_block *nb,
+		unsigned long action, void *data)
+{
+	struct device *dev = data;
+
+	switch (action) {
+	case BUS_NOTIFY_ADD_DEVICE:
+	case BUS_NOTIFY_BOUND_DRIVER:
+		tx2_uncore_link_endpoint(dev, true);
+		break;
+	case BUS_NOTIFY_DEL_DEVICE:
+		tx2_uncore_link_endpoint(dev, false);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block tx2_uncore_pci_nb = {
+	.notifier_call = tx2_uncore_pci_notify,
+};
+
+static int tx2_uncore_pmu_online_cpu(unsigned int cpu,
+		struct hlist_node *hpnode)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+	unsigned int engine_cpu;
+
+	tx2_pmu = hlist_entry_safe(hpnode,
+			struct tx2_uncore_pmu, hpnode);
+
+	if (!cpumask_test_cpu(cpu, tx2_uncore_pmu_cpus(tx2_pmu)))
+		return 0;
+
+	/*
+	 * A PMU left without a CPU takes one again, and a PMU that had to
+	 * fall back to an isolated CPU moves once a housekeeping CPU of
+	 * its node comes online.
+	 */
+	mutex_lock(&tx2_pmus_lock);
+	if (tx2_pmu->cpu >= nr_cpu_ids)
+		tx2_pmu->cpu = tx2_uncore_pick_cpu(tx2_pmu, nr_cpu_ids);
+	else if (!tx2_uncore_housekeeping_cpu(tx2_pmu->cpu) &&
+		 tx2_uncore_housekeeping_cpu(cpu))
+		tx2_uncore_pmu_migrate(tx2_pmu,
+				       tx2_uncore_pick_cpu(tx2_pmu, nr_cpu_ids));
+	engine_cpu = tx2_pmu->engine ? READ_ONCE(tx2_pmu->engine->cpu) :
+				       nr_cpu_ids;
+	if (engine_cpu < nr_cpu_ids &&
+	    !tx2_uncore_housekeeping_cpu(engine_cpu) &&
+	    tx2_uncore_housekeeping_cpu(tx2_pmu->cpu))
+		tx2_uncore_engine_move(tx2_pmu->engine, engine_cpu,
+				       tx2_pmu->cpu);
+	mutex_unlock(&tx2_pmus_lock);
+
+	return 0;
+}
+
+static int tx2_uncore_pmu_offline_cpu(unsigned int cpu,
+		struct hlist_node *hpnode)
+{
+	struct tx2_uncore_pmu *tx2_pmu;
+
+	tx2_pmu = hlist_entry_safe(hpnode,
+			struct tx2_uncore_pmu, hpnode);
+
+	mutex_lock(&tx2_pmus_lock);
+	if (cpu == tx2_pmu->cpu)
+		tx2_uncore_pmu_migrate(tx2_pmu,
+				       tx2_uncore_pick_cpu(tx2_pmu, cpu));
+	if (tx2_pmu->engine)
+		tx2_uncore_engine_move(tx2_pmu->engine, cpu, tx2_pmu->cpu);
+	mutex_unlock(&tx2_pmus_lock);
 	return 0;
 }
 
 static int __init smmu_perf_init(void)
 {
-	int node, smmu;
+	struct pci_dev *pdev = NULL;
+	int node, ret;
+
+	BUILD_BUG_ON(SMMU_PERF_EVENT_MAX > TX2_SMMU_RING_MAX_COUNTERS);
+
+	ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN,
+				      "perf/tx2/smmu:online",
+				      tx2_uncore_pmu_online_cpu,
+				      tx2_uncore_pmu_offline_cpu);
+	if (ret < 0) {
+		pr_err("SMMU PMU: setup hotplug failed, ret = %d\n", ret);
+		return ret;
+	}
+	tx2_smmu_hp_state = ret;
 
 	for_each_online_node(node) {
-		for (smmu = 0; smmu < 3; smmu++)
-			tx2_uncore_pmu_add(node, smmu);
+		if (tx2_uncore_engine_init(node))
+			pr_err("SMMU PMU: node %d engine alloc failed\n", node);
 	}
 
+	bus_for_each_dev(&platform_bus_type, NULL, NULL,
+			 tx2_uncore_smmu_probe);
+
+	/*
+	 * Aggregates go to the head of the PMU list, so they are removed
+	 * before their members on unload.
+	 */
+	for_each_online_node(node)
+		tx2_uncore_agg_add(node);
+	tx2_uncore_agg_add(NUMA_NO_NODE);
+
+	bus_register_notifier(&pci_bus_type, &tx2_uncore_pci_nb);
+	for_each_pci_dev(pdev)
+		tx2_uncore_link_endpoint(&pdev->dev, true);
+
 	pr_info("SMMU perf module loaded\n");
 	return 0;
 }
@@ -795,15 +3381,39 @@ static int __init smmu_perf_init(void)
 void smmu_perf_exit(void)
 {
 	struct tx2_uncore_pmu *tx2_pmu, *temp;
+	int node;
+
+	bus_unregister_notifier(&pci_bus_type, &tx2_uncore_pci_nb);
 
 	if (!list_empty(&tx2_pmus)) {
 		list_for_each_entry_safe(tx2_pmu, temp, &tx2_pmus, entry) {
+			cpuhp_state_remove_instance_nocalls(tx2_smmu_hp_state,
+							    &tx2_pmu->hpnode);
+			if (always_on && tx2_pmu->smmu)
+				tx2_uncore_totals_stop(tx2_pmu);
+			if (tx2_pmu->smmu) {
+				tx2_uncore_thresholds_close(tx2_pmu);
+				tx2_uncore_recorder_close(tx2_pmu);
+			}
+			debugfs_remove_recursive(tx2_pmu->debugfs);
+			if (tx2_pmu->ring_dev.fops)
+				misc_deregister(&tx2_pmu->ring_dev);
+			kobject_put(tx2_pmu->endpoints);
+			sysfs_remove_link(&tx2_pmu->pmu.dev->kobj, "smmu");
+			/* no alert may be signalled once the device is gone */
+			if (tx2_pmu->engine) {
+				tx2_uncore_engine_leave(tx2_pmu);
+				cancel_work_sync(&tx2_pmu->alert_work);
+				cancel_work_sync(&tx2_pmu->recorder_work);
+			}
 			perf_pmu_unregister(&tx2_pmu->pmu);
 			list_del(&tx2_pmu->entry);
-			iounmap(tx2_pmu->base);
-			kfree(tx2_pmu);
+			tx2_uncore_pmu_free(tx2_pmu);
 		}
 	}
+	cpuhp_remove_multi_state(tx2_smmu_hp_state);
+	for_each_node(node)
+		tx2_uncore_engine_exit(node);
 	pr_info("SMMU perf module unloaded\n");
 }
 
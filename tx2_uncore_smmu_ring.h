@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * CAVIUM THUNDERX2 SoC PMU UNCORE SMMU
+ *
+ * Layout of the counter snapshot ring of /dev/uncore_smmu_<base>. The
+ * first page of the mapping holds the header, the records follow from
+ * the second page on.
+ *
+ * The driver is the only producer: it fills the record at head, then
+ * advances head. The reader consumes the records from tail up to head,
+ * then advances tail. Both indices only grow, record n is at
+ * n % nr_records. When the ring is full, new records are dropped and
+ * counted rather than overwriting unread ones.
+ */
+
+#ifndef _TX2_UNCORE_SMMU_RING_H
+#define _TX2_UNCORE_SMMU_RING_H
+
+#include <linux/types.h>
+
+#define TX2_SMMU_RING_VERSION		1
+#define TX2_SMMU_RING_MAX_COUNTERS	32
+
+struct tx2_smmu_ring_header {
+	__u32 version;
+	__u32 record_size;
+	__u32 nr_records;
+	__u32 nr_counters;
+	__u64 head;		/* written by the driver */
+	__u64 dropped;		/* written by the driver */
+	__u64 tail;		/* written by the reader */
+};
+
+/*
+ * count[n] is the running 64-bit total of the counter of event id n,
+ * valid when bit n of active is set. Rates are deltas between records.
+ */
+struct tx2_smmu_ring_record {
+	__u64 time;		/* CLOCK_MONOTONIC, ns */
+	__u32 active;
+	__u32 reserved;
+	__u64 count[TX2_SMMU_RING_MAX_COUNTERS];
+};
+
+#endif /* _TX2_UNCORE_SMMU_RING_H */
@@ -0,0 +1,183 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * CAVIUM THUNDERX2 SoC PMU UNCORE SMMU
+ *
+ * Tracepoints of the driver itself: perf event scheduling, the counter
+ * deltas folded by the sampling engine, and the places where it can
+ * lose data (late timer, dropped ring records).
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tx2_uncore_smmu
+
+#if !defined(_TX2_UNCORE_SMMU_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TX2_UNCORE_SMMU_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Long enough for uncore_smmu_<48-bit base> */
+#define TX2_SMMU_TRACE_NAME_LEN		32
+
+DECLARE_EVENT_CLASS(tx2_smmu_event,
+
+	TP_PROTO(const char *pmu, u32 event, int counter, u32 filter,
+		 u64 count),
+
+	TP_ARGS(pmu, event, counter, filter, count),
+
+	TP_STRUCT__entry(
+		__array(char,	pmu,	TX2_SMMU_TRACE_NAME_LEN)
+		__field(u32,	event)
+		__field(int,	counter)
+		__field(u32,	filter)
+		__field(u64,	count)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->pmu, pmu, TX2_SMMU_TRACE_NAME_LEN);
+		__entry->event = event;
+		__entry->counter = counter;
+		__entry->filter = filter;
+		__entry->count = count;
+	),
+
+	TP_printk("%s event=%u counter=%d filter=0x%x count=%llu",
+		  __entry->pmu, __entry->event, __entry->counter,
+		  __entry->filter, __entry->count)
+);
+
+DEFINE_EVENT(tx2_smmu_event, tx2_smmu_event_add,
+	TP_PROTO(const char *pmu, u32 event, int counter, u32 filter,
+		 u64 count),
+	TP_ARGS(pmu, event, counter, filter, count)
+);
+
+DEFINE_EVENT(tx2_smmu_event, tx2_smmu_event_del,
+	TP_PROTO(const char *pmu, u32 event, int counter, u32 filter,
+		 u64 count),
+	TP_ARGS(pmu, event, counter, filter, count)
+);
+
+DEFINE_EVENT(tx2_smmu_event, tx2_smmu_event_start,
+	TP_PROTO(const char *pmu, u32 event, int counter, u32 filter,
+		 u64 count),
+	TP_ARGS(pmu, event, counter, filter, count)
+);
+
+DEFINE_EVENT(tx2_smmu_event, tx2_smmu_event_stop,
+	TP_PROTO(const char *pmu, u32 event, int counter, u32 filter,
+		 u64 count),
+	TP_ARGS(pmu, event, counter, filter, count)
+);
+
+/* One per active counter and sweep, total is the 64-bit running total */
+TRACE_EVENT(tx2_smmu_counter_delta,
+
+	TP_PROTO(const char *pmu, int counter, u64 delta, u64 total),
+
+	TP_ARGS(pmu, counter, delta, total),
+
+	TP_STRUCT__entry(
+		__array(char,	pmu,	TX2_SMMU_TRACE_NAME_LEN)
+		__field(int,	counter)
+		__field(u64,	delta)
+		__field(u64,	total)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->pmu, pmu, TX2_SMMU_TRACE_NAME_LEN);
+		__entry->counter = counter;
+		__entry->delta = delta;
+		__entry->total = total;
+	),
+
+	TP_printk("%s counter=%d delta=%llu total=%llu",
+		  __entry->pmu, __entry->counter, __entry->delta,
+		  __entry->total)
+);
+
+/* A 32-bit counter wrapped between two reads, and was extended */
+TRACE_EVENT(tx2_smmu_counter_wrap,
+
+	TP_PROTO(const char *pmu, int counter, u64 prev, u64 new),
+
+	TP_ARGS(pmu, counter, prev, new),
+
+	TP_STRUCT__entry(
+		__array(char,	pmu,	TX2_SMMU_TRACE_NAME_LEN)
+		__field(int,	counter)
+		__field(u64,	prev)
+		__field(u64,	new)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->pmu, pmu, TX2_SMMU_TRACE_NAME_LEN);
+		__entry->counter = counter;
+		__entry->prev = prev;
+		__entry->new = new;
+	),
+
+	TP_printk("%s counter=%d prev=0x%llx new=0x%llx",
+		  __entry->pmu, __entry->counter, __entry->prev, __entry->new)
+);
+
+/*
+ * The engine of a node expired later than its slack allows. Beyond the
+ * headroom of the interval a 32-bit counter may wrap twice unnoticed.
+ */
+TRACE_EVENT(tx2_smmu_timer_late,
+
+	TP_PROTO(int node, unsigned int cpu, u64 late, u64 interval),
+
+	TP_ARGS(node, cpu, late, interval),
+
+	TP_STRUCT__entry(
+		__field(int,		node)
+		__field(unsigned int,	cpu)
+		__field(u64,		late)
+		__field(u64,		interval)
+	),
+
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->cpu = cpu;
+		__entry->late = late;
+		__entry->interval = interval;
+	),
+
+	TP_printk("node=%d cpu=%u late=%lluns interval=%lluns",
+		  __entry->node, __entry->cpu, __entry->late,
+		  __entry->interval)
+);
+
+/* The snapshot ring was full, dropped is the total so far */
+TRACE_EVENT(tx2_smmu_ring_drop,
+
+	TP_PROTO(const char *pmu, u64 head, u64 dropped),
+
+	TP_ARGS(pmu, head, dropped),
+
+	TP_STRUCT__entry(
+		__array(char,	pmu,	TX2_SMMU_TRACE_NAME_LEN)
+		__field(u64,	head)
+		__field(u64,	dropped)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->pmu, pmu, TX2_SMMU_TRACE_NAME_LEN);
+		__entry->head = head;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("%s head=%llu dropped=%llu",
+		  __entry->pmu, __entry->head, __entry->dropped)
+);
+
+#endif /* _TX2_UNCORE_SMMU_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tx2_uncore_smmu_trace
+
+#include <trace/define_trace.h>